@@ -3,7 +3,7 @@
  * Handle with care.
  *
  * Compile like this:
- *  g++ -std=c++11 -O3 -s -o cnc3reader.exe \
+ *  g++ -std=c++11 -O3 -s -pthread -o cnc3reader.exe \
  *      cnc3reader.cpp cnc3reader_impl.cpp replayreader.cpp \
  *      -enable-auto-import -static-libgcc -static-libstdc++
  *
@@ -115,13 +115,6 @@
 
 #include "replayreader.h"
 
-extern command_map_t RA3_commands;
-extern command_map_t KW_commands;
-extern command_map_t TW_commands;
-extern command_names_t RA3_cmd_names;
-extern command_names_t KW_cmd_names;
-extern command_names_t TW_cmd_names;
-
 /** Faction names for all TW/KW/RA3 games.
  */
 std::string faction(unsigned int f, Options::GameType g);
@@ -130,24 +123,310 @@ std::string faction(unsigned int f, Options::GameType g);
  */
 bool parse_options(int argc, char * argv[], Options & opts);
 
-/** Set up type-1 chunk command codes, lengths and descriptions.
+/** Stream the --export records of a mapped replay.
+ */
+bool export_chunks(const MappedFile & file, const replay_header_t & header, const char * filename,
+                   const Options & opts, FILE * out, FILE * err);
+
+/** Add the --columns rows of a mapped replay to a column file.
  */
-void populate_command_map_RA3(command_map_t & ra3_commands, command_names_t & ra3_cmd_names);
-void populate_command_map_KW(command_map_t & kw_commands, command_names_t & kw_cmd_names);
-void populate_command_map_TW(command_map_t & tw_commands, command_names_t & tw_cmd_names);
+bool column_chunks(const MappedFile & file, const replay_header_t & header, const char * filename,
+                   const Options & opts, ColumnWriter & columns, FILE * err);
 
-void fix_replay_file(const char * filename, Options & opts);
+/** Truncate a broken replay after the good chunk at opts.fixpos and append a footer.
+ */
+bool fix_replay_file(const char * filename, Options & opts, std::ostream & log = std::cerr);
+
+/** Decode one complete chunk of a replay that is being followed into the running APM.
+ */
+bool live_apm_chunk(const chunk_view_t & chunk, unsigned int block_count, unsigned char hsix, unsigned char hnumber1,
+                    LiveApmSink & live, const Options & opts, FILE * err);
 
 bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen, unsigned int timecode,
                 unsigned char hsix, unsigned char hnumber1, std::ostream & audioout,
-                apm_1_map_t & player_1_apm, apm_2_map_t & player_2_apm,
-                apm_histo_map_t & player_indi_histo_apm, apm_histo_map_t & player_coal_histo_apm,
-                unsigned int block_count, Options::GameType gametype, const Options & opts);
+                apm_2_map_t & player_2_apm, ApmHistogram & player_histo_apm,
+                unsigned int block_count, Options::GameType gametype, const Options & opts,
+                FILE * out, FILE * err);
+
+/* Thrown when a replay is so broken that the whole program should stop;
+ * main() turns this into exit(1) once the output up to that file is written.
+ */
+struct fatal_replay_error { };
+
+/* An in-memory FILE that collects the output of one replay in batch mode, or of
+ * one stretch of a replay that is dissected on several threads.
+ */
+class CaptureFile
+{
+public:
+  CaptureFile() : file(NULL), buf(NULL), len(0)
+  {
+#ifndef _WIN32
+    file = open_memstream(&buf, &len);
+#else
+    file = tmpfile();
+#endif
+    if (file == NULL) throw std::runtime_error("Could not create output buffer.");
+  }
+
+  ~CaptureFile() { if (file) fclose(file); std::free(buf); }
+
+  FILE * get() { return file; }
+
+  /* Closes the FILE and moves its content into "s". */
+  void release(std::string & s)
+  {
+#ifndef _WIN32
+    fclose(file);
+    file = NULL;
+    s.assign(buf, len);
+#else
+    s.resize(size_t(ftell(file)));
+    rewind(file);
+    if (fread(&s[0], 1, s.size(), file) != s.size()) s.clear();
+    fclose(file);
+    file = NULL;
+#endif
+  }
+
+private:
+  CaptureFile(const CaptureFile &);
+  CaptureFile & operator=(const CaptureFile &);
+
+  FILE * file;
+  char * buf;
+  size_t len;
+};
+
+/* Intra-file parallelism for -p and -V with -j N: once a boundary pass has collected
+ * the chunks, they are dissected in N contiguous stretches on N threads, each with its
+ * own statistics and output buffers. Stitching those together in order gives exactly
+ * the result of the serial walk, including stopping after the first chunk that fails.
+ */
+const size_t PARALLEL_MIN_CHUNKS = 4096;
+
+typedef struct _stretch_result_t
+{
+  _stretch_result_t() : ok(true) {}
+
+  ApmHistogram histo;
+  apm_2_map_t  player_2_apm;
+  std::string  out, err;
+  bool         ok;
+  std::exception_ptr exception;
+} stretch_result_t;
+
+bool dissect_chunks_parallel(const std::vector<chunk_view_t> & body, unsigned int first_count,
+                             unsigned char hsix, unsigned char hnumber1,
+                             apm_2_map_t & player_2_apm, ApmHistogram & player_histo_apm,
+                             Options::GameType gametype, const Options & opts, FILE * out, FILE * err)
+{
+  const size_t nthreads = std::min<size_t>(opts.jobs, body.size() / (PARALLEL_MIN_CHUNKS / 4));
+  std::vector<stretch_result_t> results(nthreads);
+  std::vector<std::thread> pool;
+
+  for (size_t t = 0; t < nthreads; ++t)
+  {
+    pool.push_back(std::thread([&, t]()
+    {
+      stretch_result_t & r = results[t];
+      try
+      {
+        CaptureFile o, e;
+        std::ofstream noaudio;
+
+        for (size_t i = body.size() * t / nthreads, end = body.size() * (t + 1) / nthreads; i < end && r.ok; ++i)
+        {
+          r.ok = dumpchunks(body[i].data, body[i].type, body[i].length, body[i].timecode, hsix, hnumber1, noaudio,
+                            r.player_2_apm, r.histo, first_count + i, gametype, opts, o.get(), e.get());
+        }
+
+        o.release(r.out);
+        e.release(r.err);
+      }
+      catch (...)
+      {
+        r.exception = std::current_exception();
+      }
+    }));
+  }
+
+  for (size_t t = 0; t < nthreads; ++t) pool[t].join();
+
+  for (size_t t = 0; t < nthreads; ++t)
+  {
+    stretch_result_t & r = results[t];
+
+    if (r.exception) std::rethrow_exception(r.exception);
+
+    fwrite(r.err.data(), 1, r.err.size(), err);
+    fwrite(r.out.data(), 1, r.out.size(), out);
+
+    player_histo_apm.append(r.histo);
+    for (apm_2_map_t::const_iterator i = r.player_2_apm.begin(), end = r.player_2_apm.end(); i != end; ++i)
+      for (size_t k = 0; k < 4; ++k) player_2_apm[i->first].counter[k] += i->second.counter[k];
+
+    if (!r.ok) return false;
+  }
+
+  return true;
+}
+
+/* --follow: a replay that is still being written. Chunks are decoded as soon as they
+ * are complete, and the running APM of every player is printed whenever new chunks
+ * came in. An incomplete chunk at the end is kept until the rest of it is written.
+ */
+const int FOLLOW_POLL_MS = 100;
+const int FOLLOW_IDLE_MS = 120000;
+
+void print_live_apm(const LiveApmSink & live, unsigned int timecode, FILE * out)
+{
+  fprintf(out, "[%s]", timecode_to_string(timecode).c_str());
+
+  for (unsigned int p = 0; p < 256; ++p)
+  {
+    if (live.total[p] == 0) continue;
+
+    const double minute = std::max(std::min(timecode, 900U), 1U);
+    fprintf(out, "  Player %u: %.1f APM (%.1f in the last minute)", p,
+            timecode ? live.total[p] * 900.0 / timecode : 0.0, live.recent[p].size() * 900.0 / minute);
+  }
+
+  fprintf(out, "\n");
+  fflush(out);
+}
+
+bool follow_replay_file(const char * filename, size_t firstchunk, unsigned char hsix, unsigned char hnumber1,
+                        Options::GameType gametype, const Options & opts, FILE * out, FILE * err)
+{
+  FILE * f = fopen(filename, "rb");
+  if (f == NULL || fseek(f, long(firstchunk), SEEK_SET) != 0)
+  {
+    fprintf(err, "Error: Could not reopen \"%s\" for following.\n", filename);
+    if (f != NULL) fclose(f);
+    return false;
+  }
+
+#ifdef __linux__
+  /* Woken up by every write to the replay; without inotify, we just poll. */
+  int ifd = inotify_init1(IN_CLOEXEC);
+  if (ifd >= 0 && inotify_add_watch(ifd, filename, IN_MODIFY) < 0) { close(ifd); ifd = -1; }
+#endif
+
+  fprintf(out, "\n==== following the replay ====\n\n");
+  fflush(out);
+
+  LiveApmSink live(gametype);
+
+  /* The file from offset "consumed" onwards. Each round, the incomplete chunk left
+   * over from the last one moves to the other arena, and the new data goes after it.
+   */
+  ChunkArena arenas[2];
+  const unsigned char * pending = NULL;
+  size_t have = 0, consumed = firstchunk;
+  unsigned int block_count = 0, timecode = 0, cur = 0;
+  int idle = 0;
+  bool ok = true, done = false;
+
+  while (!done)
+  {
+    /* How much has been written since the last round. */
+    const long here = ftell(f);
+    long end = here;
+    if (here >= 0 && fseek(f, 0, SEEK_END) == 0)
+    {
+      end = ftell(f);
+      fseek(f, here, SEEK_SET);
+    }
+    const size_t n = end > here ? size_t(end - here) : 0;
+
+    /* The decoder relies on CHUNK_PADDING zero bytes after the data, as in a MappedFile. */
+    cur ^= 1;
+    arenas[cur].reset();
+    unsigned char * const window = arenas[cur].alloc(have + n + CHUNK_PADDING);
+    if (have) memcpy(window, pending, have);
+
+    const size_t got = n ? fread(window + have, 1, n, f) : 0;
+    const bool grew = got > 0;
+    clearerr(f);
+
+    have += got;
+    memset(window + have, 0, CHUNK_PADDING);
+    pending = window;
+
+    ChunkReader chunks(window, have, 0);
+    chunk_view_t chunk;
+    ChunkStatus status;
+    size_t used = 0;
+    bool news = false;
+
+    while ((status = chunks.next(chunk)) == CHUNK_OK)
+    {
+      if (chunk.length > 10000)
+      {
+        fprintf(err, "%s: chunk %u is too long (%u bytes).\n", filename, block_count, chunk.length);
+        ok = false;
+        done = true;
+        break;
+      }
+
+      if (!live_apm_chunk(chunk, block_count++, hsix, hnumber1, live, opts, err)) ok = false;
+      timecode = std::max(timecode, chunk.timecode);
+      used = chunks.position();
+      news = true;
+    }
+
+    if (status == CHUNK_END) done = true;
+    if (status == CHUNK_TRUNCATED) used = chunk.offset;
+
+    if (news)
+    {
+      live.trim(timecode);
+      print_live_apm(live, timecode, out);
+    }
+
+    pending += used;
+    have    -= used;
+    consumed += used;
+
+    if (done) break;
+
+    idle = grew ? 0 : idle + FOLLOW_POLL_MS;
+    if (idle >= FOLLOW_IDLE_MS)
+    {
+      fprintf(err, "%s: no new data for %d seconds, giving up at offset %u.\n",
+              filename, FOLLOW_IDLE_MS / 1000, unsigned(consumed));
+      ok = false;
+      break;
+    }
+
+#ifdef __linux__
+    if (ifd >= 0)
+    {
+      struct pollfd p = { ifd, POLLIN, 0 };
+      alignas(struct inotify_event) char events[4096];
+      if (poll(&p, 1, FOLLOW_POLL_MS) > 0 && read(ifd, events, sizeof(events)) < 0 && errno != EINTR) break;
+      continue;
+    }
+#endif
+    std::this_thread::sleep_for(std::chrono::milliseconds(FOLLOW_POLL_MS));
+  }
+
+  if (done && ok) fprintf(out, "\nThe replay is complete after %u chunks (timecode: %s).\n", block_count, timecode_to_string(timecode).c_str());
+
+#ifdef __linux__
+  if (ifd >= 0) close(ifd);
+#endif
+  fclose(f);
+  return ok;
+}
 
 /* The main worker function.
  */
-bool parse_replay_file(const char * filename, Options & opts)
+bool parse_replay_file(const char * filename, Options & opts, FILE * out, FILE * err)
 {
+  FileOStream os(out), es(err);
+
   Options::GameType gametype = opts.gametype;;
 
   header_cnc3_t header;
@@ -166,77 +445,77 @@ bool parse_replay_file(const char * filename, Options & opts)
   unknown_uints_t<19> u19;
   unknown_uints_t<20> u20;
 
-  std::cerr << "Opening file \"" << filename << "\"...";
-  std::ifstream myfile(filename, std::ios::in | std::ios::binary);
-  if (!myfile) { std::cerr << " failed!" << std::endl; return false; }
+  es << "Opening file \"" << filename << "\"...";
+  /* The file is mapped once; the header is read from the mapping field by field below,
+   * and the chunks are walked with the same ReplayStream. Whether the library's header
+   * parser accepts the file does not matter here: this one explains what is wrong.
+   */
+  ReplayStream replay;
+  replay.open(filename, gametype);
+  if (!replay.is_mapped()) { es << " failed!" << std::endl; return false; }
 
-  myfile.seekg(0, std::fstream::end);
-  int filesize = myfile.tellg();
-  std::cerr << " succeeded. File size: " << filesize << " bytes." << std::endl;
+  MemoryIStream myfile(replay.file());
+  const int filesize = int(replay.file().size());
+  es << " succeeded. File size: " << filesize << " bytes." << std::endl;
 
   std::ofstream audioout;
 
   if (!opts.type.empty())
   {
-    std::cerr << "Displaying only events of type(s) ";
-    std::copy(opts.type.begin(), opts.type.end(), std::ostream_iterator<int>(std::cerr, " "));
-    std::cerr << "." << std::endl;
+    es << "Displaying only events of type(s) ";
+    std::copy(opts.type.begin(), opts.type.end(), std::ostream_iterator<int>(es, " "));
+    es << "." << std::endl;
   }
 
   if (!opts.cmd_filter.empty())
   {
-    std::cerr << "Displaying only type-1 chunk commands of type(s) ";
-    std::copy(opts.cmd_filter.begin(), opts.cmd_filter.end(), std::ostream_iterator<int>(std::cerr, " "));
-    std::cerr << "." << std::endl;
+    es << "Displaying only type-1 chunk commands of type(s) ";
+    std::copy(opts.cmd_filter.begin(), opts.cmd_filter.end(), std::ostream_iterator<int>(es, " "));
+    es << "." << std::endl;
   }
 
   if (opts.dumpaudio)
   {
     if (opts.audiofn == NULL)
     {
-      std::cerr << "Error: You must specify the audio dump filename with the \"-A\" option." << std::endl;
+      es << "Error: You must specify the audio dump filename with the \"-A\" option." << std::endl;
       return false;
     }
 
-    std::cerr << "Attempting to dump audio tracks!" << std::endl;
+    es << "Attempting to dump audio tracks!" << std::endl;
     audioout.open(opts.audiofn, std::ios::out | std::ios::binary | std::ios::trunc);
 
     if (!audioout)
     {
-      std::cerr << "Failed to create dump file \"" << opts.audiofn << "\", not dumping audio." << std::endl;
+      es << "Failed to create dump file \"" << opts.audiofn << "\", not dumping audio." << std::endl;
     }
     else
     {
-      std::cerr << "Successfully opened dump file \"" << opts.audiofn << "\"." << std::endl;
+      es << "Successfully opened dump file \"" << opts.audiofn << "\"." << std::endl;
     }
   }
 
-  /* Unless explicitly overridden, set the game type according to filename */
+  /* Unless explicitly overridden, tell the game type from the start of the file. */
   if (gametype == Options::GAME_UNDEF)
   {
-    std::string fn(filename);
-    std::transform(fn.begin(), fn.end(), fn.begin(), ::tolower);
-    std::cerr << "Selecting game type according to file suffix: ";
-    if (fn.rfind(".cnc3replay") + 11 == fn.length())
+    const ReplayFormat format = replay.format();
+    gametype = replay.gametype();
+    es << "Selecting game type according to file contents: ";
+    switch (gametype)
     {
-      std::cerr << "We pick Tiberium Wars.";
-      gametype = Options::GAME_TW;
+    case Options::GAME_TW:  es << "We pick Tiberium Wars."; break;
+    case Options::GAME_KW:  es << "We pick Kane's Wrath."; break;
+    case Options::GAME_RA3: es << "We pick Red Alert 3."; break;
+    default:
+      if (format == REPLAY_CNC4)                es << "this is a Tiberian Twilight replay, please use cnc4reader.";
+      else if (format != REPLAY_UNKNOWN && format != REPLAY_CNC3)
+                                                es << "this is a " << replay_format_name(format) << " replay, please use ccgzhreader.";
+      else                                      es << "unable to determine game type. Please specify manually ('-w', '-k', '-r').";
+      break;
     }
-    else if (fn.rfind(".kwreplay") + 9 == fn.length())
-    {
-      std::cerr << "We pick Kane's Wrath.";
-      gametype = Options::GAME_KW;
-    }
-    else if (fn.rfind(".ra3replay") + 10 == fn.length())
-    {
-      std::cerr << "We pick Red Alert 3.";
-      gametype = Options::GAME_RA3;
-    }
-    else
-    {
-      std::cerr << "unable to determine game type. Please specify manually ('-w', '-k', '-r').";
-    }
-    std::cerr << std::endl;
+    es << std::endl;
+
+    if (format != REPLAY_UNKNOWN && format != REPLAY_CNC3 && format != REPLAY_RA3) return false;
   }
 
   myfile.seekg(0, std::fstream::beg);
@@ -252,7 +531,7 @@ bool parse_replay_file(const char * filename, Options & opts)
          ((READ_UINT32LE(header.vermajor) != 1) && (READ_UINT32LE(header.verminor) > 9))
        )
     {
-      std::cerr << "File does not seem to be a replay file." << std::endl;
+      es << "File does not seem to be a replay file." << std::endl;
       return false;
     }
     hnumber1 = header.number1;
@@ -269,7 +548,7 @@ bool parse_replay_file(const char * filename, Options & opts)
          ((READ_UINT32LE(header_ra3.vermajor) != 1) && (READ_UINT32LE(header_ra3.verminor) > 12))
        )
     {
-      std::cerr << "File does not seem to be a RA3 replay file." << std::endl;
+      es << "File does not seem to be a RA3 replay file." << std::endl;
       return false;
     }
     hnumber1 = header_ra3.number1;
@@ -305,37 +584,37 @@ bool parse_replay_file(const char * filename, Options & opts)
 
   if (gametype != Options::GAME_RA3)
   {
-    std::cout << "Game version: " << std::dec << READ_UINT32LE(header.vermajor) << "." << READ_UINT32LE(header.verminor)
+    os << "Game version: " << std::dec << READ_UINT32LE(header.vermajor) << "." << READ_UINT32LE(header.verminor)
               << ", Build: " << READ_UINT32LE(header.buildmajor) << "." << READ_UINT32LE(header.buildminor) << std::endl;
   }
   else
   {
-    std::cout << "Game version: " << std::dec << READ_UINT32LE(header_ra3.vermajor) << "." << READ_UINT32LE(header_ra3.verminor)
+    os << "Game version: " << std::dec << READ_UINT32LE(header_ra3.vermajor) << "." << READ_UINT32LE(header_ra3.verminor)
               << ", Build: " << READ_UINT32LE(header_ra3.buildmajor) << "." << READ_UINT32LE(header_ra3.buildminor) << std::endl;
   }
-  std::cout << "Title:        " << str_title << std::endl
+  os << "Title:        " << str_title << std::endl
             << "Description:  " << str_matchdesc << std::endl
             << "Map name:     " << str_mapname << std::endl
             << "Map ID:       " << str_mapid << std::endl
             << std::endl << "Number of players: " << int(nplayers) << ", + 1 additional" << std::endl;
 
-  if (hsix  == 0x1E) std::cout << "Commentary track available." << std::endl;
+  if (hsix  == 0x1E) os << "Commentary track available." << std::endl;
 
   for (size_t i = 0; i < playerNames.size(); ++i)
-    fprintf(stdout, "Team %d (ID: %08X): %s\n", playerNos[i], playerIDs[i], playerNames[i].c_str());
+    fprintf(out, "Team %d (ID: %08X): %s\n", playerNos[i], playerIDs[i], playerNames[i].c_str());
 
   myfile.read(reinterpret_cast<char*>(&dummy), 4);
   firstchunk = (unsigned int)myfile.tellg() + 4 + dummy;
 
-  fprintf(stdout, "\nOffset from CNC3RPL magic to first chunk: 0x%X, first chunk at 0x%X.\n", dummy, firstchunk);
+  fprintf(out, "\nOffset from CNC3RPL magic to first chunk: 0x%X, first chunk at 0x%X.\n", dummy, firstchunk);
 
   myfile.read(reinterpret_cast<char*>(&dummy), 4);
 
   myfile.read(cncrpl_magic, 8);
   if (dummy != 8 || strncmp(cncrpl_magic, "CNC3RPL\0", 8))
   {
-    std::cerr << "Error: Unexpected content! Aborting." << std::endl;
-    exit(1);
+    es << "Error: Unexpected content! Aborting." << std::endl;
+    throw fatal_replay_error();
   }
 
   /* For TW, version 1.07+, there is this extra bit of info, char modinfo[22]. */
@@ -358,29 +637,29 @@ bool parse_replay_file(const char * filename, Options & opts)
 
   if (gametype == Options::GAME_TW && READ_UINT32LE(header.verminor) >= 7)
   {
-    std::cout << "Interpreting file as Tiberium Wars replay. Mod info: ";
+    os << "Interpreting file as Tiberium Wars replay. Mod info: ";
     char *p(modinfo), *q(NULL);
     while (p < modinfo + 22)
     {
       q = std::strchr(p, '\0');
       if (q == NULL) break;
       if (p[0] != '\0')
-        std::cout << "\"" << p << "\" ";
+        os << "\"" << p << "\" ";
       p = q+1;
     }
-    std::cout << std::endl;
+    os << std::endl;
   }
   else if (gametype == Options::GAME_TW)
   {
-    std::cout << "Interpreting file as pre-1.07 Tiberium Wars replay." << std::endl;
+    os << "Interpreting file as pre-1.07 Tiberium Wars replay." << std::endl;
   }
   else if (gametype == Options::GAME_KW)
   {
-    std::cout << "Interpreting file as Kane's Wrath replay." << std::endl;
+    os << "Interpreting file as Kane's Wrath replay." << std::endl;
   }
   else if (gametype == Options::GAME_RA3)
   {
-    std::cout << "Interpreting file as Red Alert 3 replay. Mod info: ";
+    os << "Interpreting file as Red Alert 3 replay. Mod info: ";
     myfile.read(modinfo, 22);
     char *p(modinfo), *q(NULL);
     while (p < modinfo + 22)
@@ -388,16 +667,16 @@ bool parse_replay_file(const char * filename, Options & opts)
       q = std::strchr(p, '\0');
       if (q == NULL) break;
       if (p[0] != '\0')
-        std::cout << "\"" << p << "\" ";
+        os << "\"" << p << "\" ";
       p = q+1;
     }
-    std::cout << std::endl;
+    os << std::endl;
   }
 
   myfile.read(reinterpret_cast<char*>(&dummy), 4);
 
-  strftime(timeout, 200, "%Y-%m-%d %H:%M:%S (%Z)", gmtime(reinterpret_cast<time_t*>(&dummy)));
-  std::cout << "Timestamp: " << std::dec << dummy << ", that is " << timeout << "." << std::endl;
+  strftime_utc(timeout, 200, "%Y-%m-%d %H:%M:%S (%Z)", dummy);
+  os << "Timestamp: " << std::dec << dummy << ", that is " << timeout << "." << std::endl;
 
 
   // Skipping unknown data. We print all this later.
@@ -414,15 +693,15 @@ bool parse_replay_file(const char * filename, Options & opts)
   myfile.read(header2.data(), hlen);
 
   if (opts.printraw)
-    std::cout << "Header string length: " << std::dec << hlen << ". Raw header data:" << std::endl
+    os << "Header string length: " << std::dec << hlen << ". Raw header data:" << std::endl
               << std::string(header2.begin(), header2.end()) << std::endl << std::endl;
 
-  std::cout << std::endl << "Header string length: " << std::dec << hlen << ". Header fields:" << std::endl;
+  os << std::endl << "Header string length: " << std::dec << hlen << ". Header fields:" << std::endl;
 
   std::vector<std::string> tokens = tokenize(std::string(header2.begin(), header2.end()), ";");
   
   for (size_t i = 0; i < tokens.size(); ++i)
-    std::cout << tokens[i] << std::endl;
+    os << tokens[i] << std::endl;
 
   for (std::vector<std::string>::const_iterator it = tokens.begin(), end = tokens.end(); it != end; ++it)
   {
@@ -430,7 +709,7 @@ bool parse_replay_file(const char * filename, Options & opts)
 
     if (token[0] == 'S' && token[1] == '=')
     {
-      std::cout << std::endl << "Found player information, parsing..." << std::endl;
+      os << std::endl << "Found player information, parsing..." << std::endl;
       std::vector<std::string> subtokens = tokenize(token.substr(2), ":");
 
       for (size_t i = 0; i < subtokens.size(); ++i)
@@ -447,18 +726,18 @@ bool parse_replay_file(const char * filename, Options & opts)
 
         if (subtokens[i].size() > 2 && subtokens[i][0] == 'C' && subtokens[i][2] == ',')
         {
-          fprintf(stdout, "Computer opponent:  %s (Faction: %s) Other data: \"",
+          fprintf(out, "Computer opponent:  %s (Faction: %s) Other data: \"",
                   subsubtokens[0].c_str(), faction(std::atoi(subsubtokens[2].c_str()), gametype).c_str());
-          for (size_t j = 1; j < subsubtokens.size() - 1; ++j) std::cout << subsubtokens[j] << ", ";
+          for (size_t j = 1; j < subsubtokens.size() - 1; ++j) os << subsubtokens[j] << ", ";
         }
         else
         {
-          fprintf(stdout, "Ingame player name: %s (Faction: %s, IP addr.: 0x%08X, %d.%d.%d.%d:%s) Other data: \"",
+          fprintf(out, "Ingame player name: %s (Faction: %s, IP addr.: 0x%08X, %d.%d.%d.%d:%s) Other data: \"",
                   subsubtokens[0].c_str(), faction(std::atoi(subsubtokens[5].c_str()), gametype).c_str(), v,
                   v>>24, ((v<<8)>>24), ((v<<16)>>24), ((v<<24)>>24), subsubtokens[2].c_str());
-          for (size_t j = 3; j < subsubtokens.size() - 1; ++j) std::cout << subsubtokens[j] << ", ";
+          for (size_t j = 3; j < subsubtokens.size() - 1; ++j) os << subsubtokens[j] << ", ";
         }
-        std::cout << subsubtokens[subsubtokens.size() - 1] << "\"." << std::endl;
+        os << subsubtokens[subsubtokens.size() - 1] << "\"." << std::endl;
       }
     }
   }
@@ -468,7 +747,7 @@ bool parse_replay_file(const char * filename, Options & opts)
 
   myfile.read(reinterpret_cast<char*>(&dummy), 4);
   str_filename = read2ByteStringN(myfile, dummy);
-  std::cout << "File name (?): " << str_filename << std::endl;
+  os << "File name (?): " << str_filename << std::endl;
 
   myfile.read(reinterpret_cast<char*>(&datetime),  sizeof(datetime));
 
@@ -486,73 +765,80 @@ bool parse_replay_file(const char * filename, Options & opts)
   if (gametype == Options::GAME_RA3) myfile.read(reinterpret_cast<char*>(&u20), 20*4);
   else                               myfile.read(reinterpret_cast<char*>(&u19), 19*4);
 
-  std::cout << "Version/build magic string: \"" << str_vermagic << "\", followed by 0x"
+  os << "Version/build magic string: \"" << str_vermagic << "\", followed by 0x"
             << std::hex << std::uppercase << std::setfill('0') << std::setw(8) << after_vermagic << " and 0x"
             << std::setw(2) << (unsigned int)(onebyte) << std::endl;
 
   /* 10 uint16_t's before the version magic are another version of the time stamp:
    * Final two numbers ([8],[9]) always seem to be (14,0), (7,0) or (15,0).
    */
-  fprintf(stdout, "The literal timestamp says: \"%s, %04hu-%02hu-%02hu %02hu:%02hu:%02hu\". It is followed by the number %hu.\n",
+  fprintf(out, "The literal timestamp says: \"%s, %04hu-%02hu-%02hu %02hu:%02hu:%02hu\". It is followed by the number %hu.\n",
           weekday(datetime.data[2]), datetime.data[0], datetime.data[1], datetime.data[3],
           datetime.data[4], datetime.data[5], datetime.data[6], datetime.data[7]);
 
-  std::cout << std::endl << "===== Report on unknown header data follows ====" << std::endl;
+  os << std::endl << "===== Report on unknown header data follows ====" << std::endl;
 
   // 33 bytes skipped after global header, 'CNC3RPL ' magic and timestamp, expected all zero.
   if (gametype == Options::GAME_RA3)
   {
     if (array_is_zero(u31, 31))
     {
-      std::cout << "We skipped  31 expected mysterious bytes, which were all zero." << std::endl;
+      os << "We skipped  31 expected mysterious bytes, which were all zero." << std::endl;
     }
     else
     {
-      std::cout << std::endl << "We skipped 31 mysterious bytes which were unexpected! They were:" << std::endl;
-      hexdump(stdout, u31, 31, "  ");
+      os << std::endl << "We skipped 31 mysterious bytes which were unexpected! They were:" << std::endl;
+      hexdump(out, u31, 31, "  ");
     }
   }
   else
   {
     if (array_is_zero(u33, 33))
     {
-      std::cout << "We skipped  33 expected mysterious bytes, which were all zero." << std::endl;
+      os << "We skipped  33 expected mysterious bytes, which were all zero." << std::endl;
     }
     else
     {
-      std::cout << std::endl << "We skipped 33 mysterious bytes which were unexpected! They were:" << std::endl;
-      hexdump(stdout, u33, 33, "  ");
+      os << std::endl << "We skipped 33 mysterious bytes which were unexpected! They were:" << std::endl;
+      hexdump(out, u33, 33, "  ");
     }
   }
 
   if ((unsigned int)(dummy3[0]) < playerNames2.size())
-    fprintf(stdout, "The player who saved this replay was number %u (%s).\n", dummy3[0], playerNames2[dummy3[0]][0].c_str());
+    fprintf(out, "The player who saved this replay was number %u (%s).\n", dummy3[0], playerNames2[dummy3[0]][0].c_str());
   else
-    fprintf(stdout, "Warning: unexpected value for the index of the player who saved the replay (got: %u)!\n", dummy3[0]);
+    fprintf(out, "Warning: unexpected value for the index of the player who saved the replay (got: %u)!\n", dummy3[0]);
 
   // 8 bytes after global header #2 + 1, expected all zero.
   if (array_is_zero(reinterpret_cast<unsigned char*>(dummy3)+1, 8))
   {
-    fprintf(stdout, "We skipped   8 expected mysterious bytes which were all zero.\n");
+    fprintf(out, "We skipped   8 expected mysterious bytes which were all zero.\n");
   }
   else
   {
-    fprintf(stdout, "We skipped 8 mysterious bytes which were unexpected; values: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+    fprintf(out, "We skipped 8 mysterious bytes which were unexpected; values: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
             dummy3[1], dummy3[2], dummy3[3], dummy3[4], dummy3[5], dummy3[6], dummy3[7], dummy3[8]);
   }
 
   // 19/20 uint32_t's after the version magic
   if (gametype == Options::GAME_RA3)
   {
-    fprintf(stdout, "\nThe 20 integers after the version magic are: ");
-    for (size_t i = 0; i < 20; ++i) fprintf(stdout, "%u, ", u20.data[i]);
+    fprintf(out, "\nThe 20 integers after the version magic are: ");
+    for (size_t i = 0; i < 20; ++i) fprintf(out, "%u, ", u20.data[i]);
   }
   else
   {
-    fprintf(stdout, "\nThe 19 integers after the version magic are: ");
-    for (size_t i = 0; i < 19; ++i) fprintf(stdout, "%u, ", u19.data[i]);
+    fprintf(out, "\nThe 19 integers after the version magic are: ");
+    for (size_t i = 0; i < 19; ++i) fprintf(out, "%u, ", u19.data[i]);
+  }
+  fprintf(out, "\n");
+
+  /* A replay that is still being written has no footer yet. */
+  if (opts.follow)
+  {
+    replay.close();
+    return follow_replay_file(filename, firstchunk, hsix, hnumber1, gametype, opts, out, err);
   }
-  fprintf(stdout, "\n");
 
   uint32_t footer_offset;
   dummy = myfile.tellg();
@@ -561,107 +847,160 @@ bool parse_replay_file(const char * filename, Options & opts)
 
   if (footer_offset < 100) // a random safety check
   {
-    fprintf(stdout, "Footer length is %u.", footer_offset);
+    fprintf(out, "Footer length is %u.", footer_offset);
   }
   else
   {
-    fprintf(stdout, "Invalid footer - is this a defective replay? Footer will be ignored.\n");
+    fprintf(out, "Invalid footer - is this a defective replay? Footer will be ignored.\n");
     footer_offset = 0;
   }
 
-  if (!opts.dumpchunks && !opts.apm && !opts.printraw)
+  if (!opts.dumpchunks && !opts.apm && !opts.validate && !opts.printraw)
   {
     if (footer_offset != 0)
     {
       myfile.seekg((gametype == Options::GAME_RA3 ? 17 : 18) - int(footer_offset), std::fstream::end);
       myfile.read(reinterpret_cast<char*>(&dummy), 4);
-      fprintf(stdout, " Footer chunk number: 0x%08X (timecode: %s); %u bytes / %u frames = %.2f Bpf = %.2f Bps.\n",
+      fprintf(out, " Footer chunk number: 0x%08X (timecode: %s); %u bytes / %u frames = %.2f Bpf = %.2f Bps.\n",
               dummy, timecode_to_string(dummy).c_str(), filesize, dummy, double(filesize) / dummy, double(filesize) * 15.0 / dummy);
     }
     return true;
   }
 
-  fprintf(stdout, "\n");
+  fprintf(out, "\n");
   myfile.seekg(dummy, std::fstream::beg);
 
-  apm_1_map_t player_1_apm;
   apm_2_map_t player_2_apm;
-  apm_histo_map_t player_indi_histo_apm;
-  apm_histo_map_t player_coal_histo_apm;
+  ApmHistogram player_histo_apm;
 
   if (myfile.tellg() != firstchunk)
   {
-    fprintf(stdout, "\nWarning: We're not at the beginning of the chunks yet, difference = %d. Advancing...\n",  (int)firstchunk - (int)myfile.tellg());
+    fprintf(out, "\nWarning: We're not at the beginning of the chunks yet, difference = %d. Advancing...\n",  (int)firstchunk - (int)myfile.tellg());
     myfile.seekg(firstchunk, std::fstream::beg);
   }
 
   if (opts.apm)
   {
-    std::cout << std::endl << "==== gathering APM statistics ====" << std::endl << std::endl;
+    os << std::endl << "==== gathering APM statistics ====" << std::endl << std::endl;
+  }
+  else if (opts.validate && !opts.dumpchunks)
+  {
+    os << std::endl << "==== checking data blocks ====" << std::endl << std::endl;
   }
   else
   {
-    std::cout << std::endl << "=================================================" << std::endl
+    os << std::endl << "=================================================" << std::endl
               << std::endl << "Now dumping individual data blocks." << std::endl << std::endl;
   }
 
-  lastgood = int(myfile.tellg());
+  /* The chunk body is walked straight out of the mapping of the file;
+   * chunks are handed to the dissector in place, without copying them.
+   */
+  replay.seek(firstchunk);
+  replay_chunk_t chunk;
+  ChunkIndex index;
+  int block_count = 0;
+
+  lastgood = firstchunk;
 
-  for (int block_count = 0; !myfile.eof(); block_count++)
+  /* With --from/--to, the chunk index takes us straight to the first chunk in range. */
+  if (opts.from_tc != 0 || opts.to_tc != UINT32_MAX)
   {
-    uint32_t len;
+    if (!index.load(filename, firstchunk))
+    {
+      index.build(replay.file(), firstchunk);
+      index.save(filename, firstchunk);
+    }
 
-    myfile.read(reinterpret_cast<char*>(&dummy), 4);
+    block_count = index.lower_bound(opts.from_tc);
+    if (block_count > 0) lastgood = index[block_count - 1].offset;
+    replay.seek(size_t(block_count) < index.size() ? index[block_count].offset : index.end());
+  }
+
+  /* -p and -V with -j N: long replays are dissected on several threads. The serial
+   * loop below then only picks up whatever ended the boundary pass.
+   */
+  if ((opts.apm || opts.validate) && opts.jobs > 1 && !opts.printraw && !opts.dumpaudio)
+  {
+    std::vector<chunk_view_t> body;
+    ChunkReader scan(replay.file(), replay.position());
+    chunk_view_t view;
 
-    if (dummy == 0x7FFFFFFF) break;
+    while (scan.next(view) == CHUNK_OK && view.timecode <= opts.to_tc && view.length <= 10000)
+      body.push_back(view);
 
-    myfile.read(&onebyte, 1);
-    myfile.read(reinterpret_cast<char*>(&len), 4);
+    if (body.size() >= PARALLEL_MIN_CHUNKS)
+    {
+      if (!dissect_chunks_parallel(body, block_count, hsix, hnumber1, player_2_apm, player_histo_apm,
+                                   gametype, opts, out, err)) return false;
+
+      block_count += body.size();
+      lastgood = body.back().offset;
+      replay.seek(body.back().offset + 9 + body.back().length + 4);
+    }
+  }
+
+  for ( ; ; block_count++)
+  {
+    const ChunkStatus status = replay.next(chunk);
 
-    if (len > 10000) { throw std::length_error("Requested chunk length too big."); }
+    if (status == CHUNK_END) break;
 
-    if (myfile.eof() || filesize - myfile.tellg() < len + 4)
+    if (status == CHUNK_OK && chunk.timecode > opts.to_tc)
+    {
+      /* Past the range: straight on to the footer (or to where the replay breaks off). */
+      if (index.size() > 0) lastgood = index[index.size() - 1].offset;
+      replay.seek(index.end());
+      continue;
+    }
+
+    if (chunk.length > 10000) { throw std::length_error("Requested chunk length too big."); }
+
+    if (status == CHUNK_TRUNCATED)
     {
       if (opts.autofix)
       {
-        opts.fixfn = (std::string(filename) + "-FIXED").c_str();
+        const std::string fixfn = std::string(filename) + "-FIXED";
+        opts.fixfn = fixfn.c_str();
         opts.fixpos = lastgood;
-        std::cerr << "Warning: Unexpected end of file! Auto fix is requested, attempting to fix this replay. (Params: " << opts.fixfn << ", " << opts.fixpos << ")" << std::endl;
-        myfile.close();
+        es << "Warning: Unexpected end of file! Auto fix is requested, attempting to fix this replay. (Params: "
+           << (opts.fix_in_place ? filename : opts.fixfn) << ", " << opts.fixpos << ")" << std::endl;
+        replay.close();
         opts.gametype = gametype;
-        fix_replay_file(filename, opts);
-        return true;
+        return fix_replay_file(filename, opts, es);
       }
       else
       {
-        std::cerr << "Error: Unexpected end of file! Aborting. Try 'cnc3reader -f " << lastgood
+        es << "Error: Unexpected end of file! Aborting. Try 'cnc3reader -f " << lastgood
                   << (gametype == Options::GAME_RA3 ? " -r" : gametype == Options::GAME_KW ? " -k" : " -w")
                   << " " << filename << "' for fixing." << std::endl;
         return false;
       }
     }
 
-    std::vector<unsigned char> vbuf(len + 4);
-    lastgood = int(myfile.tellg()) - 9;
-    myfile.read(reinterpret_cast<char*>(vbuf.data()), len + 4);
-    const unsigned char * const buf = vbuf.data();
+    lastgood = chunk.offset;
+    const unsigned char * const buf = chunk.data;
 
     if (opts.printraw)
     {
-      if (is_filtered(onebyte, opts.type)) continue;
-      fprintf(stdout, "\nBlock TC: 0x%08X, timecode: %s, length: %u bytes, count: %u, filepos: 0x%X, Chunk Type: %u.\n",
-          dummy, timecode_to_string(dummy).c_str(), len, block_count, int(myfile.tellg()), onebyte);
+      if (is_filtered(chunk.type, opts.type)) continue;
+      fprintf(out, "\nBlock TC: 0x%08X, timecode: %s, length: %u bytes, count: %u, filepos: 0x%X, Chunk Type: %u.\n",
+          chunk.timecode, timecode_to_string(chunk.timecode).c_str(), chunk.length, block_count, int(replay.position()), chunk.type);
 
-      hexdump(stdout, buf, len+4, "  ");
+      hexdump(out, buf, chunk.length + 4, "  ");
     }
-    else if (opts.dumpchunks)
+    else if (opts.dumpchunks || opts.apm || opts.validate)
     {
-      if (!dumpchunks(buf, onebyte, len, dummy, hsix, hnumber1, audioout,
-                      player_1_apm, player_2_apm, player_indi_histo_apm, player_coal_histo_apm, block_count, gametype, opts)) return false;
+      if (!dumpchunks(buf, chunk.type, chunk.length, chunk.timecode, hsix, hnumber1, audioout,
+                      player_2_apm, player_histo_apm, block_count, gametype, opts, out, err)) return false;
     }
 
   } // for(...)
 
+  if (opts.validate && !opts.printraw) fprintf(out, "All data blocks decoded cleanly.\n\n");
+
+  myfile.seekg(replay.position(), std::fstream::beg);
+
   /* Process the footer */
   if (gametype == Options::GAME_RA3)
   {
@@ -675,47 +1014,47 @@ bool parse_replay_file(const char * filename, Options & opts)
   if ((gametype != Options::GAME_RA3 && strncmp(cncfooter_magic, "C&C3 REPLAY FOOTER", 18)) ||
       (gametype == Options::GAME_RA3 && strncmp(cncfooter_magic, "RA3 REPLAY FOOTER", 17))     )
   {
-    std::cerr << "Error: Unexpected content! Aborting." << std::endl;
-    exit(1);
+    es << "Error: Unexpected content! Aborting." << std::endl;
+    throw fatal_replay_error();
   }
 
   uint32_t final_timecode;
   myfile.read(reinterpret_cast<char*>(&final_timecode), 4);
-  fprintf(stdout, "Footer magic string as expected.\nFooter chunk number: 0x%08X (timecode: %s).\n",
+  fprintf(out, "Footer magic string as expected.\nFooter chunk number: 0x%08X (timecode: %s).\n",
           final_timecode, timecode_to_string(final_timecode).c_str());
 
   std::vector<char> footerdata(footer_offset - 8 - (gametype == Options::GAME_RA3 ? 17 : 18));
   myfile.read(footerdata.data(), footerdata.size());
-  fprintf(stdout, "Numbers in the footer:");
-  for (size_t i = 0; i < footerdata.size(); ++i) fprintf(stdout, " 0x%02X", (unsigned char)(footerdata[i]));
-  fprintf(stdout, ".\n");
+  fprintf(out, "Numbers in the footer:");
+  for (size_t i = 0; i < footerdata.size(); ++i) fprintf(out, " 0x%02X", (unsigned char)(footerdata[i]));
+  fprintf(out, ".\n");
 
   if (footerdata.size() == 42 || footerdata.size() == 38)
   {
-    fprintf(stdout, "Ints in the footer:");
+    fprintf(out, "Ints in the footer:");
 
     for (size_t i = 6; i + 28 <= footerdata.size(); i += 4)
-      fprintf(stdout, " %i", *reinterpret_cast<const uint32_t*>(footerdata.data() + i));
+      fprintf(out, " %i", *reinterpret_cast<const uint32_t*>(footerdata.data() + i));
 
-    fprintf(stdout, ". Six floats in the footer:");
+    fprintf(out, ". Six floats in the footer:");
 
     for (size_t i = footerdata.size() - 24; i + 4 <= footerdata.size(); i += 4)
-      fprintf(stdout, " %6.2f", *reinterpret_cast<const float*>(footerdata.data() + i));
-    fprintf(stdout, "\n");
+      fprintf(out, " %6.2f", *reinterpret_cast<const float*>(footerdata.data() + i));
+    fprintf(out, "\n");
   }
 
 
   /* Report APM stats */
   if (opts.apm)
   {
-    const command_names_t & cmd_names = gametype == Options::GAME_TW ? TW_cmd_names
+    const command_name_table_t & cmd_names = gametype == Options::GAME_TW ? TW_cmd_names
         : (gametype == Options::GAME_KW ? KW_cmd_names : RA3_cmd_names);
 
     std::map<unsigned int, std::pair<unsigned int, unsigned int>> apm_total;
 
-    fprintf(stdout, "\nAPM statistics: Type-2 Chunks\n");
+    fprintf(out, "\nAPM statistics: Type-2 Chunks\n");
     for (apm_2_map_t::const_iterator i = player_2_apm.begin(), end = player_2_apm.end(); i != end; ++i)
-      fprintf(stdout,
+      fprintf(out,
               "Player %u: 1s-heartbeats: %u (%.1f). Len40: %u (%.1f). Len24: %u (%.1f). Other: %u (%.1f).\n",
               i->first,
               i->second.counter[0], (double)(i->second.counter[0])*15.0*60.0/(double)(final_timecode),
@@ -724,98 +1063,143 @@ bool parse_replay_file(const char * filename, Options & opts)
               i->second.counter[3], (double)(i->second.counter[3])*15.0*60.0/(double)(final_timecode)
               );
 
-    fprintf(stdout, "\nAPM statistics: Type-1 Chunks\n");
+    /* The raw player bytes 8k, ..., 8k+7 all belong to the same player. */
+    apm_1_map_t player_1_apm;
+    for (unsigned int p = 0; p < 256; ++p)
+    {
+      if (!player_histo_apm.player(p)) continue;
+      for (unsigned int c = 0; c < 256; ++c)
+        player_1_apm[mangle_player(p, gametype)] += player_histo_apm.player(p)->commands[c].size();
+    }
+
+    fprintf(out, "\nAPM statistics: Type-1 Chunks\n");
     for (apm_1_map_t::const_iterator i = player_1_apm.begin(), end = player_1_apm.end() ; i != end; ++i)
     {
-      fprintf(stdout, "Player %u: %u\n", i->first, i->second);
+      fprintf(out, "Player %u: %u\n", i->first, i->second);
     }
 
-    fprintf(stdout, "\nAPM statistics: Type-1 command histogram\n");
+    fprintf(out, "\nAPM statistics: Type-1 command histogram\n");
 
-    for (apm_histo_map_t::const_iterator i = player_indi_histo_apm.begin(), end = player_indi_histo_apm.end(); i != end; ++i)
+    for (unsigned int p = 0; p < 256; ++p)
     {
-      for (auto j = i->second.begin(), end = i->second.end(); j != end; ++j)
+      const ApmHistogram::player_t * const ph = player_histo_apm.player(p);
+      if (!ph) continue;
+
+      for (unsigned int c = 0; c < 256; ++c)
       {
-        const command_names_t::const_iterator nit = cmd_names.find(j->first);
-        const std::string cn = nit == cmd_names.end() ? "" : nit->second;
-        fprintf(stdout, "Raw player 0x%02X -->   command 0x%02X: %u (\"%s\")\n",
-                i->first, j->first, j->second.size(), cn.c_str());
+        if (ph->commands[c].empty()) continue;
+        const char * const cn = command_name(cmd_names, c);
+        fprintf(out, "Raw player 0x%02X -->   command 0x%02X: %u (\"%s\")\n",
+                p, c, unsigned(ph->commands[c].size()), cn);
       }
     }
 
-    for (apm_histo_map_t::const_iterator i = player_coal_histo_apm.begin(), end = player_coal_histo_apm.end(); i != end; ++i)
+    for (unsigned int g = 0; g < 256; g += 8)
     {
-      for (auto j = i->second.begin(), end = i->second.end(); j != end; ++j)
+      bool seen = false;
+      const unsigned int player = mangle_player(g, gametype);
+
+      for (unsigned int c = 0; c < 256; ++c)
       {
-        const command_names_t::const_iterator nit = cmd_names.find(j->first);
-        const std::string cn = nit == cmd_names.end() ? "" : nit->second;
-        fprintf(stdout, "Player %u, command 0x%02X: %u (\"%s\")\n",
-                i->first, j->first, j->second.size(), cn.c_str());
-
-        const unsigned int & c = j->first;
-
-        /* RA3 APM filter: 0x37: some automatic, irregular sync command ("scroll"??)
-                           0x21: hearbeat, every 3 seconds
-           KW  APM filter: 0x8F: some automatic, irregular sync command ("scroll"??)
-                           0x61: heartbeat, every 30 seconds
-           TW  APM filter: 0x85: some automatic, irregular sync command ("scroll"??)
-                           0x57: heartbeat, every 30 seconds
-
-
-           All games:      0xF5: drag selection box and/or select units. We could micro-filter this depending on how many units got selected.
-                           0xF8: left-click on the map, can be used to "deselect" a selected unit, but is also caused by dumb blank clicks.
-        */
-          
-        if ((gametype == Options::GAME_RA3 && c != 0x21 && c != 0x37) ||
-            (gametype == Options::GAME_TW  && c != 0x85 && c != 0x57) ||
-            (gametype == Options::GAME_KW  && c != 0x8F && c != 0x61)   )
+        size_t count = 0;
+        for (unsigned int p = g; p < g + 8; ++p)
+          if (player_histo_apm.player(p)) count += player_histo_apm.player(p)->commands[c].size();
+
+        if (count == 0) continue;
+        seen = true;
+
+        const char * const cn = command_name(cmd_names, c);
+        fprintf(out, "Player %u, command 0x%02X: %u (\"%s\")\n",
+                player, c, unsigned(count), cn);
+
+        if (apm_counted(c, gametype))
         {
-          apm_total[i->first].first += j->second.size();
+          apm_total[player].first += count;
 
           if (c != 0xF8 && c != 0xF5)
-            apm_total[i->first].second += j->second.size();
+            apm_total[player].second += count;
         }
       }
-      fprintf(stdout, "\n");
+      if (seen) fprintf(out, "\n");
     }
 
     if (!opts.time_series_filter.empty())
     {
-      fprintf(stdout, "Event time series:\n");
-      for (apm_histo_map_t::const_iterator i = player_coal_histo_apm.begin(), end = player_coal_histo_apm.end(); i != end; ++i)
+      fprintf(out, "Event time series:\n");
+      for (unsigned int g = 0; g < 256; g += 8)
       {
-        for (auto j = i->second.begin(), end = i->second.end(); j != end; ++j)
+        for (unsigned int c = 0; c < 256; ++c)
         {
-          if (opts.time_series_filter.find(j->first) == opts.time_series_filter.end()) continue;
+          if (opts.time_series_filter.find(c) == opts.time_series_filter.end()) continue;
+
+          /* Merge the (sorted) timecode lists of all raw player bytes of this player. */
+          ApmHistogram::timecodes_t series, merged;
+          for (unsigned int p = g; p < g + 8; ++p)
+          {
+            if (!player_histo_apm.player(p)) continue;
+            const ApmHistogram::timecodes_t & tc = player_histo_apm.player(p)->commands[c];
+            merged.clear();
+            std::merge(series.begin(), series.end(), tc.begin(), tc.end(), std::back_inserter(merged));
+            series.swap(merged);
+          }
+
+          if (series.empty()) continue;
+          if (!std::is_sorted(series.begin(), series.end())) std::sort(series.begin(), series.end());
 
-          const command_names_t::const_iterator nit = cmd_names.find(j->first);
-          const std::string cn = nit == cmd_names.end() ? "" : nit->second;
+          const char * const cn = command_name(cmd_names, c);
 
-          fprintf(stdout, "Player %u, command 0x%02X (\"%s\"):", i->first, j->first, cn.c_str());
-          for (auto k = j->second.cbegin(), end = j->second.cend(); k != end; ++k)
+          fprintf(out, "Player %u, command 0x%02X (\"%s\"):", mangle_player(g, gametype), c, cn);
+          for (auto k = series.cbegin(), end = series.cend(); k != end; ++k)
           {
-            std::cout << " " << timecode_to_string(*k);
+            os << " " << timecode_to_string(*k);
           }
-          fprintf(stdout, "\n");
+          fprintf(out, "\n");
         }
       }
-      fprintf(stdout, "\n");
+      fprintf(out, "\n");
     }
 
-    fprintf(stdout, "Experimental APM count:\n");
+    fprintf(out, "Experimental APM count:\n");
     for (auto it = apm_total.cbegin(), end = apm_total.cend(); it != end; ++it)
     {
-      fprintf(stdout, "  Player %u: %u actions including clicks (%.1f apm), %u actions excluding clicks (%.1f apm)\n",
+      fprintf(out, "  Player %u: %u actions including clicks (%.1f apm), %u actions excluding clicks (%.1f apm)\n",
               it->first, it->second.first, double(it->second.first * 60 * 15)/double(final_timecode),
               it->second.second, double(it->second.second * 60 * 15)/double(final_timecode));
     }
 
+    /* --window: the same actions, over time. */
+    if (opts.apm_window != 0)
+    {
+      ApmTimeline timeline;
+      timeline.build(player_histo_apm, gametype, final_timecode);
+
+      const unsigned int w = opts.apm_window;
+      const std::vector<unsigned int> players = timeline.players();
+
+      fprintf(out, "\nAPM over windows of %s:\n", timecode_to_string(w).c_str());
+      for (size_t i = 0; i != players.size(); ++i)
+      {
+        const unsigned int p = players[i];
+        unsigned int start, start_nc;
+        const double peak = timeline.peak_apm(p, w, start), peak_nc = timeline.peak_apm(p, w, start_nc, false);
+
+        fprintf(out, "  Player %u: peak %.1f apm including clicks (from %s), %.1f apm excluding clicks (from %s)\n",
+                p, peak, timecode_to_string(start).c_str(), peak_nc, timecode_to_string(start_nc).c_str());
+
+        fprintf(out, "  Player %u, per window:", p);
+        for (unsigned int t = 0; t < timeline.length(); t += w)
+          fprintf(out, " %.1f", timeline.apm(p, t, t + w));
+        fprintf(out, "\n");
+      }
+    }
+
     if (footerdata.size() == 42 || footerdata.size() == 38)
     {
-      fprintf(stdout, "\nKill/death ratios:\n");
+      fprintf(out, "\nKill/death ratios:\n");
 
-      for (size_t i = footerdata.size() - 24, n = 0; i + 4 <= footerdata.size(); i += 4)
-        fprintf(stdout, "  Player %u: %6.2f\n", n++, *reinterpret_cast<const float*>(footerdata.data() + i));
+      unsigned int n = 0;
+      for (size_t i = footerdata.size() - 24; i + 4 <= footerdata.size(); i += 4)
+        fprintf(out, "  Player %u: %6.2f\n", n++, *reinterpret_cast<const float*>(footerdata.data() + i));
     }
 
   }
@@ -823,6 +1207,573 @@ bool parse_replay_file(const char * filename, Options & opts)
   return true;
 }
 
+/* The first 64 KiB of a replay hold its entire header, the last 256 bytes the footer. */
+const size_t HEADER_REGION = 65536, FOOTER_REGION = 256;
+
+/* The --catalog mode: one line per replay, from the header and the footer regions.
+ */
+bool catalog_replay_file(const char * filename, const Options & opts, FILE * out, FILE * err)
+{
+  std::vector<unsigned char> head, tail;
+  uint64_t filesize;
+
+  if (!read_head_and_tail(filename, HEADER_REGION, FOOTER_REGION, head, tail, filesize))
+  {
+    fprintf(err, "%s: could not read file.\n", filename);
+    return false;
+  }
+
+  replay_header_t header;
+  const Options::GameType gametype = opts.gametype != Options::GAME_UNDEF ? opts.gametype : sniff_game(head.data(), head.size(), game_from_filename(filename));
+
+  if (!parse_replay_header(head.data(), head.size(), gametype, header))
+  {
+    fprintf(err, "%s: %s\n", filename, head.size() == HEADER_REGION ? "not a replay file, or header larger than 64 KiB." : "not a replay file.");
+    return false;
+  }
+
+  replay_footer_t footer;
+  const bool have_footer = parse_replay_footer(tail.data(), tail.size(), header.gametype, footer);
+
+  fprintf(out, "%s\t%s\t%u.%u\t%s\t%s\t", filename,
+          header.gametype == Options::GAME_RA3 ? "RA3" : header.gametype == Options::GAME_TW ? "TW" : "KW",
+          header.vermajor, header.verminor, header.mapname.c_str(),
+          have_footer ? timecode_to_string(footer.final_timecode).c_str() : "-");
+
+  for (size_t i = 0; i < header.players.size(); ++i)
+    fprintf(out, "%s%s (%s)", i ? ", " : "", header.players[i].name.c_str(), faction(header.players[i].faction, header.gametype).c_str());
+
+  fprintf(out, "\t");
+
+  if (!have_footer || footer.kill_death.empty()) fprintf(out, "-");
+  for (size_t i = 0; have_footer && i < footer.kill_death.size(); ++i)
+    fprintf(out, "%s%.2f", i ? " " : "", footer.kill_death[i]);
+
+  fprintf(out, "\n");
+
+  return true;
+}
+
+/* Maps a TW/KW/RA3 replay and parses its header, for the modes below that work on the
+ * mapped chunks; false, with a message, if it is no such replay.
+ */
+bool open_tw_replay(ReplayStream & replay, const char * filename, const Options & opts, FILE * err)
+{
+  if (replay.open(filename, opts.gametype) && (replay.format() == REPLAY_CNC3 || replay.format() == REPLAY_RA3)) return true;
+
+  fprintf(err, replay.is_mapped() ? "%s: not a replay file.\n" : "%s: could not read file.\n", filename);
+  return false;
+}
+
+/* The --index mode: writes the chunk index sidecar of a replay.
+ */
+bool index_replay_file(const char * filename, const Options & opts, FILE * out, FILE * err)
+{
+  ReplayStream replay;
+  ChunkIndex index;
+
+  if (!open_tw_replay(replay, filename, opts, err)) return false;
+
+  index.build(replay.file(), replay.first_chunk());
+
+  if (!index.save(filename, replay.first_chunk()))
+  {
+    fprintf(err, "%s: could not write the chunk index \"%s.idx\".\n", filename, filename);
+    return false;
+  }
+
+  const MappedFile & mapped = replay.file();
+  const bool complete = index.end() + 4 <= mapped.size() && READ_UINT32LE(mapped.data() + index.end()) == 0x7FFFFFFF;
+
+  fprintf(out, "%s: %u chunks indexed, last time code %s%s.\n", filename, unsigned(index.size()),
+          index.size() ? timecode_to_string(index[index.size() - 1].timecode).c_str() : "-",
+          complete ? "" : " (the replay breaks off there)");
+
+  return true;
+}
+
+/* The --export mode: only the header is parsed, then the chunk records are streamed.
+ */
+bool export_replay_file(const char * filename, const Options & opts, FILE * out, FILE * err)
+{
+  ReplayStream replay;
+
+  if (!open_tw_replay(replay, filename, opts, err)) return false;
+
+  return export_chunks(replay.file(), replay.header(), filename, opts, out, err);
+}
+
+/* The --columns mode: the records of all replays go into one column file. Replays
+ * are read one after the other, since they all append to the same columns.
+ */
+bool write_column_file(char * const * files, size_t nfiles, const Options & opts, FILE * out, FILE * err)
+{
+  ColumnWriter columns;
+  bool ok = true;
+
+  for (size_t i = 0; i != nfiles; ++i)
+  {
+    ReplayStream replay;
+
+    if (!open_tw_replay(replay, files[i], opts, err))
+    {
+      ok = false;
+    }
+    else if (!column_chunks(replay.file(), replay.header(), files[i], opts, columns, err))
+    {
+      ok = false;
+    }
+
+    if (!ok && opts.breakonerror) return false;
+  }
+
+  if (!columns.write(opts.columnsfn))
+  {
+    fprintf(err, "Could not write the column file \"%s\".\n", opts.columnsfn);
+    return false;
+  }
+
+  fprintf(out, "Wrote %u replays to \"%s\".\n", unsigned(nfiles), opts.columnsfn);
+  return ok;
+}
+
+/* The --scan-columns mode: duration, commands and APM per player of every replay
+ * in the column files, straight from the columns.
+ */
+bool scan_column_files(char * const * files, size_t nfiles, FILE * out, FILE * err)
+{
+  bool ok = true;
+
+  for (size_t k = 0; k != nfiles; ++k)
+  {
+    ColumnFile cf;
+
+    if (!cf.open(files[k]))
+    {
+      fprintf(err, "%s: not a column file.\n", files[k]);
+      ok = false;
+      continue;
+    }
+
+    for (size_t i = 0; i != cf.nfiles(); ++i)
+    {
+      const column_file_entry_t & f = cf.file(i);
+      const Options::GameType gametype = Options::GameType(f.gametype);
+      const uint8_t * kind = cf.kind() + f.first_row, * player = cf.player() + f.first_row, * cmd = cf.cmd() + f.first_row;
+      unsigned int commands[256] = { 0 };
+
+      for (size_t r = 0; r != f.nrows; ++r)
+        if (kind[r] == 1 && apm_counted(cmd[r], gametype)) commands[player[r]]++;
+
+      const uint32_t duration = f.final_timecode;
+
+      fprintf(out, "%s\t%s", cf.file_name(i), timecode_to_string(duration).c_str());
+      for (unsigned int p = 0; p != 256; ++p)
+        if (commands[p]) fprintf(out, "\tplayer %u: %u (%.1f APM)", p, commands[p], duration ? commands[p] * 900.0 / duration : 0.0);
+      fprintf(out, "\n");
+    }
+  }
+
+  return ok;
+}
+
+/* -g on its own: finds the end of the chunk framing from the tail of the file,
+ * and repairs the replay if it breaks off before the footer. Hundreds of crashed
+ * replays take a moment.
+ */
+bool repair_replay_file(const char * filename, const Options & opts, FILE * out, FILE * err)
+{
+  ReplayStream replay;
+
+  if (!open_tw_replay(replay, filename, opts, err)) return false;
+
+  const replay_header_t & header = replay.header();
+  const MappedFile & mapped = replay.file();
+  const size_t tailsize = std::min(FOOTER_REGION, mapped.size());
+
+  size_t lastgood;
+  const ChunkStatus status = find_last_chunk(mapped, header.firstchunk, lastgood);
+
+  replay_footer_t footer;
+  if (status == CHUNK_END)
+  {
+    /* The chunks are all there; a footer we do not understand is no reason to cut it off. */
+    if (parse_replay_footer(mapped.data() + mapped.size() - tailsize, tailsize, header.gametype, footer))
+    {
+      fprintf(out, "%s: complete, nothing to fix.\n", filename);
+      return true;
+    }
+    fprintf(err, "%s: invalid footer after the last chunk, leaving the file alone.\n", filename);
+    return false;
+  }
+
+  const Options::GameType gametype = header.gametype;
+  replay.close();
+
+  if (lastgood == 0)
+  {
+    fprintf(err, "%s: breaks off before the first chunk, cannot be fixed.\n", filename);
+    return false;
+  }
+
+  const std::string fixfn = std::string(filename) + "-FIXED";
+  Options fix_opts(opts);
+  fix_opts.fixfn    = fixfn.c_str();
+  fix_opts.fixpos   = lastgood;
+  fix_opts.gametype = gametype;
+
+  FileOStream os(out);
+  return fix_replay_file(filename, fix_opts, os);
+}
+
+/* "-g" on its own only repairs; a replay it could not repair makes the run fail. */
+bool repair_only(const Options & opts)
+{
+  return opts.autofix && !opts.dumpchunks && !opts.apm && !opts.validate;
+}
+
+/* Parses one replay file, with all output going to "out" and "err". Returns
+ * false on error; throws fatal_replay_error if we must stop altogether.
+ */
+bool process_replay_file_uncached(const char * filename, Options opts, FILE * out, FILE * err)
+{
+  FileOStream os(out);
+  bool res;
+
+  try
+  {
+    if (opts.catalog)          res = catalog_replay_file(filename, opts, out, err);
+    else if (opts.build_index) res = index_replay_file(filename, opts, out, err);
+    else if (opts.export_format != Options::EXPORT_NONE)
+                               res = export_replay_file(filename, opts, out, err);
+    else if (repair_only(opts)) res = repair_replay_file(filename, opts, out, err);
+    else                       res = parse_replay_file(filename, opts, out, err);
+  }
+  catch (const fatal_replay_error &)
+  {
+    throw;
+  }
+  catch (const std::exception & e)
+  {
+    os << "Exception: " << e.what() << std::endl;
+    res = false;
+  }
+  catch (...)
+  {
+    os << "Unknown Exception!" << std::endl;
+    res = false;
+  }
+
+  if (!res && opts.breakonerror) return false;
+
+  if (!opts.catalog && !opts.build_index && opts.export_format == Options::EXPORT_NONE && !repair_only(opts))
+    os << std::endl << std::endl;
+
+  return res;
+}
+
+/* The --cache: results of earlier runs, for the summary modes. */
+ResultCache result_cache;
+
+/* The options that the output of a cacheable mode depends on, as a string; empty if
+ * the mode is not cached. Dumps are not: they are too big, and too quick to redo
+ * relative to their size.
+ */
+std::string cache_mode(const Options & opts)
+{
+  if (!opts.catalog && !opts.apm && !opts.validate) return "";
+  if (opts.dumpchunks || opts.printraw || opts.dumpaudio || opts.autofix || opts.build_index || opts.follow ||
+      opts.export_format != Options::EXPORT_NONE) return "";
+
+  std::ostringstream m;
+  std::set<int>::const_iterator it;
+
+  m << (opts.catalog ? "catalog" : "") << (opts.apm ? " apm" : "") << (opts.validate ? " validate" : "")
+    << " game " << opts.gametype << " verbose " << opts.verbose << " range " << opts.from_tc << "-" << opts.to_tc << " window " << opts.apm_window
+    << " H " << opts.filter_heartbeat << " e " << opts.breakonerror << " t";
+  for (it = opts.type.begin(); it != opts.type.end(); ++it) m << " " << *it;
+  m << " T";
+  for (it = opts.cmd_filter.begin(); it != opts.cmd_filter.end(); ++it) m << " " << *it;
+  m << " P";
+  for (it = opts.time_series_filter.begin(); it != opts.time_series_filter.end(); ++it) m << " " << *it;
+
+  return m.str();
+}
+
+bool process_replay_file(const char * filename, Options opts, FILE * out, FILE * err)
+{
+  const std::string mode = opts.cachefn != NULL ? cache_mode(opts) : std::string();
+  file_identity_t id;
+
+  if (mode.empty() || !file_identity(filename, id)) return process_replay_file_uncached(filename, opts, out, err);
+
+  std::string o, e;
+  bool res;
+
+  if (!result_cache.lookup(filename, mode, id, o, e, res))
+  {
+    CaptureFile cout_, cerr_;
+    bool fatal = false;
+
+    try
+    {
+      res = process_replay_file_uncached(filename, opts, cout_.get(), cerr_.get());
+    }
+    catch (const fatal_replay_error &)
+    {
+      fatal = true;
+    }
+
+    cout_.release(o);
+    cerr_.release(e);
+
+    if (fatal)
+    {
+      fwrite(e.data(), 1, e.size(), err);
+      fwrite(o.data(), 1, o.size(), out);
+      throw fatal_replay_error();
+    }
+
+    result_cache.store(filename, mode, id, o, e, res);
+  }
+
+  fwrite(e.data(), 1, e.size(), err);
+  fwrite(o.data(), 1, o.size(), out);
+  return res;
+}
+
+
+
+
+/* Batch mode: replays are parsed on a pool of worker threads, and a reorder
+ * buffer writes each file's output in input order as soon as all previous
+ * files are done. The output is thus identical to that of the serial loop.
+ * At most "window" files are in flight at any time, to bound memory use.
+ */
+struct batch_result_t
+{
+  batch_result_t() : done(false), res(false), fatal(false) {}
+  std::string out, err;
+  bool done, res, fatal;
+};
+
+int process_replay_files_parallel(char * const * files, size_t nfiles, const Options & opts)
+{
+  const size_t window = 4 * opts.jobs;
+
+  /* The files are already spread over the threads; each one is parsed serially. */
+  Options file_opts(opts);
+  file_opts.jobs = 1;
+
+  std::vector<batch_result_t> results(nfiles);
+  std::mutex mx;
+  std::condition_variable cv_done, cv_window;
+  size_t next = 0, written = 0;
+  bool stop = false;
+
+  auto worker = [&]()
+  {
+    for ( ; ; )
+    {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mx);
+        cv_window.wait(lock, [&]() { return stop || next >= nfiles || next < written + window; });
+        if (stop || next >= nfiles) return;
+        i = next++;
+      }
+
+      batch_result_t r;
+      try
+      {
+        CaptureFile out, err;
+        try
+        {
+          r.res = process_replay_file(files[i], file_opts, out.get(), err.get());
+        }
+        catch (const fatal_replay_error &)
+        {
+          r.fatal = true;
+        }
+        out.release(r.out);
+        err.release(r.err);
+      }
+      catch (const std::exception & e)
+      {
+        r.err = std::string("Error: ") + e.what() + "\n";
+        r.fatal = true;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mx);
+        results[i].out.swap(r.out);
+        results[i].err.swap(r.err);
+        results[i].res = r.res;
+        results[i].fatal = r.fatal;
+        results[i].done = true;
+      }
+      cv_done.notify_one();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned int k = 0; k < opts.jobs && k < nfiles; ++k) pool.push_back(std::thread(worker));
+
+  int retval = 0;
+
+  for (size_t i = 0; i < nfiles; ++i)
+  {
+    batch_result_t r;
+    {
+      std::unique_lock<std::mutex> lock(mx);
+      cv_done.wait(lock, [&]() { return results[i].done; });
+      std::swap(r, results[i]);
+    }
+
+    fwrite(r.err.data(), 1, r.err.size(), stderr);
+    fwrite(r.out.data(), 1, r.out.size(), stdout);
+
+    if (r.fatal || (!r.res && opts.breakonerror))
+    {
+      retval = 1;
+      break;
+    }
+    if (!r.res && repair_only(opts)) retval = 1;
+
+    {
+      std::lock_guard<std::mutex> lock(mx);
+      written = i + 1;
+    }
+    cv_window.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    stop = true;
+  }
+  cv_window.notify_all();
+
+  for (size_t k = 0; k < pool.size(); ++k) pool[k].join();
+
+  return retval;
+}
+
+/* The --watch mode: new replays in the watched directories, i.e. those closed after
+ * writing or moved in, are processed like files on the command line. Files that
+ * arrive in a burst are collected until the directories have been quiet for a
+ * moment, and then processed as one batch (in parallel with -j).
+ */
+const int WATCH_QUIET_MS = 250;
+const size_t WATCH_MAX_BATCH = 256;
+
+/* New files are picked by their magic, whatever they are called; chunk indexes,
+ * caches and the like written to the same directories are left alone.
+ */
+bool starts_like_replay(const std::string & path)
+{
+  std::vector<unsigned char> head, tail;
+  uint64_t filesize;
+
+  if (!read_head_and_tail(path.c_str(), SNIFF_BYTES, 0, head, tail, filesize)) return false;
+
+  const ReplayFormat format = sniff_replay(head.data(), head.size());
+  return format == REPLAY_CNC3 || format == REPLAY_RA3;
+}
+
+void process_watch_batch(std::vector<std::string> & batch, const Options & opts)
+{
+  std::vector<char *> files;
+  struct stat st;
+
+  /* Files that were moved on or deleted again in the meantime are not news. */
+  for (size_t i = 0; i != batch.size(); ++i)
+    if (stat(batch[i].c_str(), &st) == 0) files.push_back(&batch[i][0]);
+
+  if (opts.jobs > 1 && files.size() > 1)
+  {
+    process_replay_files_parallel(files.data(), files.size(), opts);
+  }
+  else for (size_t i = 0; i != files.size(); ++i)
+  {
+    try
+    {
+      process_replay_file(files[i], opts, stdout, stderr);
+    }
+    catch (const fatal_replay_error &)
+    {
+    }
+  }
+
+  fflush(stdout);
+  if (opts.cachefn != NULL) result_cache.save(opts.cachefn);
+
+  batch.clear();
+}
+
+int watch_replay_dirs(char * const * dirs, size_t ndirs, const Options & opts)
+{
+#ifdef __linux__
+  const int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) { std::cerr << "Could not start watching: " << strerror(errno) << std::endl; return 1; }
+
+  std::map<int, std::string> watched;
+
+  for (size_t i = 0; i != ndirs; ++i)
+  {
+    const int wd = inotify_add_watch(fd, dirs[i], IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) { std::cerr << "Could not watch \"" << dirs[i] << "\": " << strerror(errno) << std::endl; close(fd); return 1; }
+    watched[wd] = dirs[i];
+  }
+
+  std::cerr << "Watching " << ndirs << " director" << (ndirs == 1 ? "y" : "ies") << " for new replays." << std::endl;
+
+  alignas(struct inotify_event) char buf[65536];
+  std::vector<std::string> batch;
+
+  for ( ; ; )
+  {
+    struct pollfd p = { fd, POLLIN, 0 };
+    const int r = poll(&p, 1, batch.empty() ? -1 : WATCH_QUIET_MS);
+
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) { std::cerr << "Error while watching: " << strerror(errno) << std::endl; break; }
+
+    if (r == 0)
+    {
+      process_watch_batch(batch, opts);
+      continue;
+    }
+
+    const ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) { std::cerr << "Error while watching: " << strerror(errno) << std::endl; break; }
+
+    for (const char * q = buf; q < buf + n; )
+    {
+      const struct inotify_event * ev = reinterpret_cast<const struct inotify_event *>(q);
+      q += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) std::cerr << "Warning: Too many new files at once, some of them were missed." << std::endl;
+
+      if (ev->len == 0 || (ev->mask & IN_ISDIR)) continue;
+
+      const std::string path = watched[ev->wd] + "/" + ev->name;
+      if (!starts_like_replay(path)) continue;
+      if (std::find(batch.begin(), batch.end(), path) == batch.end()) batch.push_back(path);
+    }
+
+    if (batch.size() >= WATCH_MAX_BATCH) process_watch_batch(batch, opts);
+  }
+
+  close(fd);
+  return 1;
+#else
+  (void)dirs; (void)ndirs; (void)opts;
+  std::cerr << "'--watch' is only available on Linux." << std::endl;
+  return 1;
+#endif
+}
+
 int main(int argc, char * argv[])
 {
   Options opts;
@@ -833,37 +1784,53 @@ int main(int argc, char * argv[])
   if (opts.fixbroken)
   {
     if (optind + 1 != argc) { std::cerr << "Can only fix one replay file at a time." << std::endl; return 0; }
-    if (opts.fixfn == NULL) opts.fixfn = (std::string(argv[optind]) + "-FIXED").c_str();
+    const std::string fixfn = std::string(argv[optind]) + "-FIXED";
+    if (opts.fixfn == NULL) opts.fixfn = fixfn.c_str();
     fix_replay_file(argv[optind], opts);
   }
+  else if (opts.columnsfn != NULL)
+  {
+    return write_column_file(argv + optind, argc - optind, opts, stdout, stderr) || !opts.breakonerror ? 0 : 1;
+  }
+  else if (opts.scan_columns)
+  {
+    return scan_column_files(argv + optind, argc - optind, stdout, stderr) || !opts.breakonerror ? 0 : 1;
+  }
   else
   {
-    populate_command_map_RA3(RA3_commands, RA3_cmd_names);
-    populate_command_map_KW(KW_commands, KW_cmd_names);
-    populate_command_map_TW(TW_commands, TW_cmd_names);
+    if (opts.export_format == Options::EXPORT_CSV)
+      fputs("file,timecode,chunk,type,player,cmd,name,length,floats\n", stdout);
 
-    for ( ; optind < argc; ++optind)
+    if (opts.cachefn != NULL) result_cache.load(opts.cachefn);
+
+    if (opts.watch) return watch_replay_dirs(argv + optind, argc - optind, opts);
+
+    int retval = 0;
+
+    if (opts.jobs > 1 && !opts.follow && argc - optind > 1)
+    {
+      retval = process_replay_files_parallel(argv + optind, argc - optind, opts);
+    }
+    else for ( ; optind < argc; ++optind)
     {
       bool res;
       try
       {
-        res = parse_replay_file(argv[optind], opts);
-      }
-      catch (const std::exception & e)
-      {
-        std::cout << "Exception: " << e.what() << std::endl;
-        res = false;
+        res = process_replay_file(argv[optind], opts, stdout, stderr);
       }
-      catch (...)
+      catch (const fatal_replay_error &)
       {
-        std::cout << "Unknown Exception!" << std::endl;
-        res = false;
+        exit(1);
       }
 
-      if (!res && opts.breakonerror) return 1;
-
-      std::cout << std::endl << std::endl;
+      if (!res && opts.breakonerror) { retval = 1; break; }
+      if (!res && repair_only(opts)) retval = 1;
     }
+
+    if (opts.cachefn != NULL && !result_cache.save(opts.cachefn))
+      std::cerr << "Could not write the result cache \"" << opts.cachefn << "\"." << std::endl;
+
+    return retval;
   }
 
   return 0;
@@ -1,9 +1,7 @@
 #include "replayreader.h"
 
 const uint32_t TERM = 0x7FFFFFFF;
-const char FOOTERCC[] = "C&C3 REPLAY FOOTER";
-const char FOOTERRA3[] = "RA3 REPLAY FOOTER";
-      char FINAL[] = { 0x02, 0x7F, 0x00, 0x00, 0x00 };
+const char FINAL[] = { 0x02, 0x7F, 0x00, 0x00, 0x00 };
 
 std::string faction(unsigned int f, Options::GameType g)
 {
@@ -55,14 +53,82 @@ std::string faction(unsigned int f, Options::GameType g)
   }
 }
 
+enum { OPT_CATALOG = 256, OPT_INDEX, OPT_FROM, OPT_TO, OPT_IN_PLACE, OPT_EXPORT, OPT_COLUMNS, OPT_SCAN_COLUMNS, OPT_CACHE, OPT_WATCH, OPT_FOLLOW, OPT_WINDOW };
+
 bool parse_options(int argc, char * argv[], Options & opts)
 {
+  static const struct option long_options[] =
+  {
+    { "catalog", no_argument,       NULL, OPT_CATALOG },
+    { "index",   no_argument,       NULL, OPT_INDEX },
+    { "from",    required_argument, NULL, OPT_FROM },
+    { "to",      required_argument, NULL, OPT_TO },
+    { "in-place", no_argument,      NULL, OPT_IN_PLACE },
+    { "export",  required_argument, NULL, OPT_EXPORT },
+    { "columns", required_argument, NULL, OPT_COLUMNS },
+    { "scan-columns", no_argument,  NULL, OPT_SCAN_COLUMNS },
+    { "cache",   required_argument, NULL, OPT_CACHE },
+    { "watch",   no_argument,       NULL, OPT_WATCH },
+    { "follow",  no_argument,       NULL, OPT_FOLLOW },
+    { "window",  required_argument, NULL, OPT_WINDOW },
+    { NULL, 0, NULL, 0 }
+  };
+
   int opt;
 
-  while ((opt = getopt(argc, argv, "A:t:T:f:F:egaRcCkwrpP:H:vh")) != -1)
+  while ((opt = getopt_long(argc, argv, "A:t:T:f:F:egaRcCkwrpP:VH:j:vh", long_options, NULL)) != -1)
   {
     switch (opt)
     {
+    case OPT_CATALOG:
+      opts.catalog = true;
+      break;
+    case OPT_INDEX:
+      opts.build_index = true;
+      break;
+    case OPT_FROM:
+    case OPT_TO:
+      if (!parse_timecode_arg(optarg, opt == OPT_FROM ? opts.from_tc : opts.to_tc))
+      {
+        std::cerr << "Invalid time code \"" << optarg << "\"; use frames (\"1234\") or minutes and seconds (\"12:30\")." << std::endl;
+        return false;
+      }
+      break;
+    case OPT_EXPORT:
+      if      (std::strcmp(optarg, "ndjson") == 0) opts.export_format = Options::EXPORT_NDJSON;
+      else if (std::strcmp(optarg, "csv") == 0)    opts.export_format = Options::EXPORT_CSV;
+      else
+      {
+        std::cerr << "Unknown export format \"" << optarg << "\"; use \"ndjson\" or \"csv\"." << std::endl;
+        return false;
+      }
+      break;
+    case OPT_COLUMNS:
+      opts.columnsfn = optarg;
+      break;
+    case OPT_SCAN_COLUMNS:
+      opts.scan_columns = true;
+      break;
+    case OPT_CACHE:
+      opts.cachefn = optarg;
+      break;
+    case OPT_WATCH:
+      opts.watch = true;
+      break;
+    case OPT_WINDOW:
+      if (!parse_timecode_arg(optarg, opts.apm_window) || opts.apm_window == 0)
+      {
+        std::cerr << "Invalid window \"" << optarg << "\"; use frames (\"900\") or minutes and seconds (\"1:00\")." << std::endl;
+        return false;
+      }
+      opts.apm = true;
+      break;
+    case OPT_FOLLOW:
+      opts.follow = true;
+      break;
+    case OPT_IN_PLACE:
+      opts.fix_in_place = true;
+      break;
     case 'f':
       opts.fixbroken = true;
       opts.fixpos = atoi(optarg);
@@ -109,6 +175,9 @@ bool parse_options(int argc, char * argv[], Options & opts)
     case 'P':
       opts.time_series_filter = parse_int_sequence_arg(optarg);
       break;
+    case 'V':
+      opts.validate = true;
+      break;
     case 'k':
       opts.gametype = Options::GAME_KW;
       break;
@@ -121,11 +190,24 @@ bool parse_options(int argc, char * argv[], Options & opts)
     case 'v':
       opts.verbose = true;
       break;
+    case 'j':
+      opts.jobs = std::strtoul(optarg, NULL, 0);
+      if (opts.jobs == 0) opts.jobs = std::thread::hardware_concurrency();
+      if (opts.jobs == 0) opts.jobs = 1;
+      break;
     case 'h':
     default:
       std::cout << std::endl
-                << "Usage:  cnc3reader [-c|-C|-R] [-a] [-A audiofilename] [-w|-k|-r] [-t type] [-T cmd] [-g] [-e] [-p] [-P cmd] filename [filename]..." << std::endl
-                << "        cnc3reader -f pos [-F name] [-w|-k|-r] filename" << std::endl
+                << "Usage:  cnc3reader [-c|-C|-R] [-a] [-A audiofilename] [-w|-k|-r] [-t type] [-T cmd] [-g] [-e] [-p] [-P cmd] [-V] [-j N] [--from t] [--to t] [--cache file] filename [filename]..." << std::endl
+                << "        cnc3reader --catalog [-w|-k|-r] [-j N] [--cache file] filename [filename]..." << std::endl
+                << "        cnc3reader --index [-w|-k|-r] [-j N] filename [filename]..." << std::endl
+                << "        cnc3reader --export ndjson|csv [-w|-k|-r] [-t type] [-T cmd] [-j N] [--from t] [--to t] filename [filename]..." << std::endl
+                << "        cnc3reader --columns out [-w|-k|-r] [-t type] [-T cmd] [--from t] [--to t] filename [filename]..." << std::endl
+                << "        cnc3reader --scan-columns columnfile [columnfile]..." << std::endl
+                << "        cnc3reader --watch [options] directory [directory]..." << std::endl
+                << "        cnc3reader --follow [-w|-k|-r] filename" << std::endl
+                << "        cnc3reader -g [--in-place] [-w|-k|-r] [-j N] filename [filename]..." << std::endl
+                << "        cnc3reader -f pos [-F name | --in-place] [-w|-k|-r] filename" << std::endl
                 << "        cnc3reader -h" << std::endl << std::endl
                 << "        -c:          dump chunks (smart parsing)" << std::endl
                 << "        -C:          dump chunks (smart parsing), but also print raw chunks (implies '-c')" << std::endl
@@ -136,11 +218,33 @@ bool parse_options(int argc, char * argv[], Options & opts)
                 << "        -T cmd:      filter type-1 chunks with command number 'cmd'; only effective with '-c'" << std::endl
                 << "        -p:          gather APM statistics" << std::endl
                 << "        -P cmd:      display time series for commands" << std::endl
-                << "        -w, -k, -r:  interpret as Tiberium Wars / Kane's Wrath / Red Alert 3 replay (otherwise treat as Kane's Wrath if unsure)" << std::endl
+                << "        --window t:  with '-p' (implied), also print the APM of every player in consecutive windows" << std::endl
+                << "                     of t (frames or minutes:seconds), and the peak APM over any such window" << std::endl
+                << "        -V:          check that all chunks decode cleanly, without dumping them (not with -c or -C)" << std::endl
+                << "        -w, -k, -r:  interpret as Tiberium Wars / Kane's Wrath / Red Alert 3 replay (otherwise told from the file contents)" << std::endl
                 << "        -f pos:      attempt to fix the replay file from last good position pos" << std::endl
                 << "        -F name:     output filename for fixed replay file" << std::endl
-                << "        -g:          automatically attempt to fix broken replays" << std::endl
+                << "        -g:          automatically attempt to fix broken replays; on its own, only the chunk framing is" << std::endl
+                << "                     read, and broken replays are written to \"<replay>-FIXED\"" << std::endl
+                << "        --in-place:  with '-f' or '-g', truncate the broken replay itself instead of writing a fixed copy" << std::endl
                 << "        -e:          stop processing if an error occurs and return non-zero return value" << std::endl
+                << "        -j N:        process N files in parallel (0: one per CPU); the output is the same as without '-j'" << std::endl
+                << "        --catalog:   print one tab-separated line per replay: file, game, version, map, duration," << std::endl
+                << "                     players (faction), kill/death ratios; only header and footer are read" << std::endl
+                << "        --index:     write a chunk index next to each replay (\"<replay>.idx\")" << std::endl
+                << "        --export f:  write one record per type-1 command and per type-2 chunk instead of the dump, as" << std::endl
+                << "                     NDJSON (f = ndjson) or CSV (f = csv); diagnostics go to stderr" << std::endl
+                << "        --columns out: write the records of all replays into the columnar binary file 'out'" << std::endl
+                << "        --scan-columns: print the duration and the commands and APM per player of each replay in" << std::endl
+                << "                     the given column files, without reading the replays" << std::endl
+                << "        --cache file: keep the results of '--catalog', '-p' and '-V' in 'file', and answer unchanged" << std::endl
+                << "                     replays from there next time" << std::endl
+                << "        --watch:     keep running, and process every replay that is written to or moved into one" << std::endl
+                << "                     of the given directories, with the other options (Linux only)" << std::endl
+                << "        --follow:    follow a replay that is still being written, and print the running APM of" << std::endl
+                << "                     every player as new chunks come in, until the replay is complete" << std::endl
+                << "        --from t, --to t: only process the chunks with time codes from t to t (inclusive), given" << std::endl
+                << "                     as frames or as minutes:seconds; the chunk index is built on first use" << std::endl
                 << "        -h:          print usage information (this)" << std::endl
                 << std::endl << "  The filters -t, -T and -P accept a comma-separated series of values, for example \"-t 3,4\"." << std::endl
                 << std::endl;
@@ -148,757 +252,751 @@ bool parse_options(int argc, char * argv[], Options & opts)
     }
   }
 
+  if (opts.validate && opts.dumpchunks && !opts.printraw)
+  {
+    std::cerr << "'-V' decodes the chunks without dumping them, so it cannot be combined with '-c' or '-C'." << std::endl;
+    return false;
+  }
+
   if (opts.autofix)
   {
     std::cerr << "Will attempt to fix broken replays automatically." << std::endl;
-    opts.printraw = true;
-    opts.dumpchunks = true;
-    opts.type.clear();
-    opts.type.insert(0);
   }
 
-  if (opts.apm)
+  if (opts.jobs > 1 && opts.dumpaudio)
   {
-    opts.dumpchunks = true;
-    opts.cmd_filter.clear();
-    opts.cmd_filter.insert(0xFFFF);
+    std::cerr << "All audio tracks go to the same file, so '-a' cannot be combined with '-j'. Processing files one by one." << std::endl;
+    opts.jobs = 1;
   }
 
   return true;
 }
 
-void fix_replay_file(const char * filename, Options & opts)
+/* Cuts the replay off after the good chunk at opts.fixpos and closes it with a
+ * terminator and a footer. Only that chunk's framing is read; the good part is
+ * copied to opts.fixfn without passing through this process, or, with
+ * --in-place, the replay itself is truncated.
+ */
+bool fix_replay_file(const char * filename, Options & opts, std::ostream & log)
 {
   if (opts.gametype == Options::GAME_UNDEF)
   {
-    std::cerr << "You must specify the game type explicitly. Try '-h' for help." << std::endl;
-    return;
+    log << "You must specify the game type explicitly. Try '-h' for help." << std::endl;
+    return false;
   }
   else
   {
-    std::cerr << "Interpreting input file as game "
+    log << "Interpreting input file as game "
               << (opts.gametype == Options::GAME_RA3 ? "Red Alert 3" : opts.gametype == Options::GAME_KW ? "Kane's Wrath" : "Tiberium Wars")
               << "." << std::endl;
   }
 
-  std::cerr << "Fixing file " << filename << ", writing output to " << opts.fixfn << ". Opening file \"" << filename << "\"...";
-  std::ifstream myfile(filename, std::ios::in | std::ios::binary);
-  if (!myfile) { std::cerr << " failed!" << std::endl; return; }
+  if (opts.fix_in_place) log << "Fixing file " << filename << " in place. Opening file \"" << filename << "\"...";
+  else                   log << "Fixing file " << filename << ", writing output to " << opts.fixfn << ". Opening file \"" << filename << "\"...";
 
-  myfile.seekg(0, std::fstream::end);
-  unsigned int filesize = myfile.tellg();
-  std::cerr << " succeeded. File size: " << filesize << " bytes." << std::endl;
+  uint32_t time_code, chunk_size;
+  uint64_t filesize;
 
-  if (filesize < opts.fixpos)
   {
-    std::cerr << "Error: Specified rescue position (" << opts.fixpos << ") exceeds file size. Aborting." << std::endl;
-    return;
-  }
+    MappedFile myfile;
+    if (!myfile.open(filename)) { log << " failed!" << std::endl; return false; }
 
-  uint32_t time_code, chunk_size;
-  char     chunk_type;
+    filesize = myfile.size();
+    log << " succeeded. File size: " << filesize << " bytes." << std::endl;
 
-  myfile.seekg(opts.fixpos, std::fstream::beg);
-  myfile.read(reinterpret_cast<char*>(&time_code), 4);
-  myfile.read(&chunk_type, 1);
-  myfile.read(reinterpret_cast<char*>(&chunk_size), 4);
+    if (filesize < opts.fixpos)
+    {
+      log << "Error: Specified rescue position (" << opts.fixpos << ") exceeds file size. Aborting." << std::endl;
+      return false;
+    }
 
-  if (myfile.eof() || filesize - myfile.tellg() < chunk_size + 4)
-  {
-    std::cerr << "Error: Specified rescue position (" << opts.fixpos << ") does not point to a good chunk. Aborting." << std::endl;
-    return;
-  }
-  else
-  {
-    std::cerr << "OK, last good chunk found, timecode " << std::hex << time_code << ", length " << std::dec << chunk_size << std::endl;
-  }
+    const unsigned char * chunk = myfile.data() + opts.fixpos;
+    chunk_size = filesize - opts.fixpos >= 9 ? READ_UINT32LE(chunk + 5) : 0;
 
-  std::ofstream yourfile(opts.fixfn, std::ios::out | std::ios::binary);
-  if (!yourfile)
-  {
-    std::cerr << "Error opening output file \"" << opts.fixfn << "\", aborting." << std::endl;
-    return;
+    if (filesize - opts.fixpos < 9 || filesize - opts.fixpos - 9 < uint64_t(chunk_size) + 4)
+    {
+      log << "Error: Specified rescue position (" << opts.fixpos << ") does not point to a good chunk. Aborting." << std::endl;
+      return false;
+    }
+
+    time_code = READ_UINT32LE(chunk);
+    log << "OK, last good chunk found, timecode " << std::hex << time_code << ", length " << std::dec << chunk_size << std::endl;
   }
 
-  const unsigned int BUFSIZE = 65536, rescue_target = opts.fixpos + 13 + chunk_size;
-  unsigned int bit = 0;
-  char buf[BUFSIZE];
+  const uint64_t rescue_target = uint64_t(opts.fixpos) + 13 + chunk_size;
+
+  /* Terminator, footer magic, final time code, and a footer body that has no kill/death data. */
+  char trailer[4 + 18 + 4 + 5];
+  size_t n = 0;
+
+  memcpy(trailer, &TERM, 4);                                     n += 4;
+  if (opts.gametype == Options::GAME_RA3) { memcpy(trailer + n, FOOTERRA3, 17); n += 17; }
+  else                                    { memcpy(trailer + n, FOOTERCC,  18); n += 18; }
+  memcpy(trailer + n, &time_code, 4);                            n += 4;
+  memcpy(trailer + n, FINAL, 5);
+  trailer[n + 1] = (opts.gametype == Options::GAME_RA3 ? 0x1A : 0x1B); n += 5;
 
-  yourfile.seekp(0, std::fstream::beg);
-  myfile.seekg(0, std::fstream::beg);
-  while ((unsigned int)(myfile.tellg()) + BUFSIZE <= rescue_target)
+  log << "Rescued " << rescue_target << " bytes. Writing new footer." << std::endl;
+
+  const bool ok = opts.fix_in_place ? truncate_and_append(filename, rescue_target, trailer, n)
+                                    : copy_file_prefix(filename, opts.fixfn, rescue_target, trailer, n);
+
+  if (!ok)
   {
-    myfile.read(buf, BUFSIZE);
-    yourfile.write(buf, BUFSIZE);
+    if (opts.fix_in_place) log << "Error truncating \"" << filename << "\" in place, aborting." << std::endl;
+    else                   log << "Error writing output file \"" << opts.fixfn << "\", aborting." << std::endl;
   }
-  if ((bit = rescue_target - myfile.tellg()) > 0)
+
+  return ok;
+}
+
+/* Lengths of the variable-length type-1 commands. A command consists of the command byte,
+ * the player byte and (cmd_len_byte - 2) further bytes, followed by groups of 32-bit values
+ * whose count is given by the high nibble of the group's leading byte, and the 0xFF terminator.
+ */
+size_t varlen_command_length(const unsigned char * buf, size_t pos, size_t len, size_t cmd_len_byte)
+{
+  const size_t opos = pos;
+
+  pos += cmd_len_byte;
+
+  while (pos < len && buf[pos] != 0xFF)
   {
-    myfile.read(buf, bit);
-    yourfile.write(buf, bit);
+    pos += 4 * ((buf[pos] >> 4) + 1) + 1;
   }
 
-  std::cerr << "Rescued " << rescue_target << " bytes. Writing new footer." << std::endl;
+  return pos + 1 - opos;
+}
+
+/* The command with two strings and a number (TW 0x81, KW 0x8B, RA3 0x33). */
+size_t uuid_command_length(const unsigned char * buf, size_t pos)
+{
+  const size_t opos = pos;
 
-  yourfile.write(reinterpret_cast<const char*>(&TERM), 4);
-  if (opts.gametype == Options::GAME_RA3) { FINAL[1] = 0x1A; yourfile.write(FOOTERRA3, 17); }
-  else                                    { FINAL[1] = 0x1B; yourfile.write(FOOTERCC,  18); }
-  yourfile.write(reinterpret_cast<char*>(&time_code), 4);
-  yourfile.write(FINAL, 5);
+  pos += buf[pos + 3] + 5;
+  pos += 2 * buf[pos] + 2;
+
+  return pos + 5 - opos;
 }
 
-bool parse_chunk1_fixlen(const unsigned char * buf, size_t & pos, size_t opos, 
-                         unsigned int cmd_id, size_t counter,
-                         size_t cmd_len, const Options & opts)
+void print_chunk1_uuid(const command_event_t & ev, FILE * out)
 {
-  if (buf[opos + cmd_len - 1] == 0xFF)
+  const unsigned char * const buf = ev.data;
+  size_t l = buf[3], pos = 0;
+
+  std::string s1(buf + 4, buf + 4 + l);
+
+  fprintf(out, " %2u: Command 0x%02X: First string length %u, \"%s\".", ev.counter, ev.cmd_id, unsigned(l), s1.c_str());
+
+  pos += l + 5;
+
+  l = buf[pos];
+
+  std::string s2 = read2ByteString((const char*)buf + pos + 1, 2 * l);
+
+  pos += 2 * l + 2;
+
+  fprintf(out, " Second string length %u, \"%s\". Number: 0x%08X.\n", unsigned(l), s2.c_str(), READ_UINT32LE(buf + pos));
+}
+
+/* The text dump of the type-1 chunks (options -c and -C). */
+template <typename Game>
+struct TextSink : public NullSink
+{
+  TextSink(const Options & o, FILE * f) : opts(o), out(f) { }
+
+  void chunk1_begin(const unsigned char * buf, size_t chunklen, unsigned int timecode, unsigned int block_count, size_t ncommands)
   {
-    if (!is_filtered(int(cmd_id), opts.cmd_filter))
+    if (!opts.apm && opts.dumpchunkswithraw)
     {
-      fprintf(stdout, " %2i: Command 0x%02X, fixed length %u.\n", counter, cmd_id, cmd_len);
-      hexdump(stdout, buf + opos, cmd_len, "     ");
+      fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Number of commands: %u."
+              //" Payload:"
+              "\n  Dissecting chunk commands.\n",
+              timecode, timecode_to_string(timecode).c_str(), block_count, unsigned(chunklen), 1U, unsigned(ncommands));
     }
-    pos += cmd_len;
+
+    /* We've completed the dissector, no more need for the raw dump! */
+    if (opts.dumpchunkswithraw)
+      hexdump(out, buf+5, chunklen-5, "  ");
+
+    /* This next line was used during the learning phase to gather command statistics. */
+    //if (ncommands == 1) fprintf(out, "MASTERPLAN 0x%02X %u\n", (int)buf[5], chunklen-5);
   }
-  else
+
+  void command(const command_event_t & ev)
   {
-    fprintf(stdout,
-            "PANIC: fixed command length (%u) for command (0x%02X) does not lead to terminator, but to 0x%02X!\n",
-            cmd_len, cmd_id, buf[opos + cmd_len - 1]);
-    return false;
+    if (ev.length == 0 || opts.apm || is_filtered(int(ev.cmd_id), opts.cmd_filter)) return;
+
+    const char * prefix = "     ";
+    char s[10];
+
+    if (ev.table_len > 0)
+    {
+      fprintf(out, " %2u: Command 0x%02X, fixed length %u.\n", ev.counter, ev.cmd_id, unsigned(ev.length));
+    }
+    else if (ev.table_len < 0)
+    {
+      if (opts.dumpchunkswithraw)
+      {
+        for (size_t pos = -ev.table_len; pos + 1 < ev.length; pos += 4 * ((ev.data[pos] >> 4) + 1) + 1)
+        {
+          fprintf(out, "    --> lenbyteval: %u, values:", ev.data[pos] & 0x0F);
+          for (size_t i = 0; i != size_t(ev.data[pos] >> 4) + 1; ++i) fprintf(out, " %u", READ_UINT32LE(ev.data + pos + 1 + 4 * i));
+          fprintf(out, "\n");
+        }
+      }
+      fprintf(out, " %2u: Command 0x%02X, variable length %u.\n", ev.counter, ev.cmd_id, unsigned(ev.length));
+    }
+    else if (!ev.recognized)
+    {
+      sprintf(s, " %2u: ", ev.counter);
+      prefix = s;
+    }
+    else if (ev.cmd_id == Game::uuid_command)
+    {
+      print_chunk1_uuid(ev, out);
+    }
+    else
+    {
+      fprintf(out, " %2u: Command 0x%02X, special length %u.\n", ev.counter, ev.cmd_id, unsigned(ev.length));
+    }
+
+    hexdump(out, ev.data, ev.length, prefix);
   }
-  return true;
-}
 
-bool parse_chunk1_varlen(const unsigned char * buf, size_t & pos,
-                         unsigned int cmd_id, size_t counter, size_t len,
-                         size_t cmd_len_byte, const Options & opts)
+  void chunk1_end()
+  {
+    if (!opts.apm && opts.dumpchunkswithraw) fprintf(out, "\n");
+  }
+
+  const Options & opts;
+  FILE * out;
+};
+
+/* The --export sink: one record per type-1 command and per type-2 chunk, as an NDJSON
+ * object or as a CSV row with the columns file,timecode,chunk,type,player,cmd,name,length,floats.
+ * Player numbers are those of mangle_player() for commands, and the chunk's own for type 2.
+ */
+template <typename Game>
+struct ExportSink : public NullSink
 {
-  const size_t opos = pos;
+  ExportSink(const Options & o, const char * fn, RecordBuffer & r) : opts(o), filename(fn), rec(r), block(0) { }
 
-  pos += cmd_len_byte;
+  void chunk1_begin(const unsigned char * /* buf */, size_t /* chunklen */, unsigned int /* timecode */,
+                    unsigned int block_count, size_t /* ncommands */)
+  {
+    block = block_count;
+  }
 
-  while (buf[pos] != 0xFF && pos < len)
+  void command(const command_event_t & ev)
   {
-    const size_t adv = (buf[pos] >> 4) + 1;
+    if (ev.length == 0 || is_filtered(int(ev.cmd_id), opts.cmd_filter)) return;
 
-    if (opts.dumpchunkswithraw && (!is_filtered(int(cmd_id), opts.cmd_filter)))
+    const char * name = command_name(Game::command_names(), ev.cmd_id);
+
+    begin(ev.timecode, block, 1, Game::mangle_player(ev.player));
+
+    if (opts.export_format == Options::EXPORT_NDJSON)
     {
-      fprintf(stdout, "    --> lenbyteval: %u, values:", buf[pos] & 0x0F);
-      for (size_t i = 0; i != adv; ++i) fprintf(stdout, " %u", READ_UINT32LE(buf + pos + 1 + 4 * i));
-      fprintf(stdout, "\n");
+      rec.put(",\"cmd\":");
+      rec.put_uint(ev.cmd_id);
+      rec.put(",\"name\":");
+      rec.put_json_string(name);
+      rec.put(",\"length\":");
+      rec.put_uint(ev.length);
+      rec.put("}\n");
+    }
+    else
+    {
+      rec.put(',');
+      rec.put_uint(ev.cmd_id);
+      rec.put(',');
+      rec.put_csv_field(name);
+      rec.put(',');
+      rec.put_uint(ev.length);
+      rec.put(",\n");
     }
-
-    pos += 4 * adv + 1;
   }
 
-  ++pos;
-
-  if (!is_filtered(int(cmd_id), opts.cmd_filter))
+  void player_chunk(unsigned int player_id, const unsigned char * buf, size_t chunklen,
+                    unsigned int timecode, unsigned int block_count)
   {
-    fprintf(stdout, " %2i: Command 0x%02X, variable length %u.\n", counter, cmd_id, pos - opos);
-    hexdump(stdout, buf + opos, pos - opos, "     ");
-  }
+    if (is_filtered(2, opts.type) || heartbeat_filtered(timecode, opts)) return;
 
-  return true;
-}
+    const bool json = opts.export_format == Options::EXPORT_NDJSON;
 
-bool parse_chunk1_uuid(const unsigned char * buf, size_t & pos, size_t len, unsigned int cmd_id, size_t counter, const Options & opts)
-{
-  size_t l = buf[pos + 3];
-  if (len < l) return false;
+    begin(timecode, block_count, 2, player_id);
 
-  std::string s1(buf + pos + 4, buf + pos + 4 + l);
+    rec.put(json ? ",\"length\":" : ",,,");
+    rec.put_uint(chunklen);
+    rec.put(json ? ",\"floats\":[" : ",");
 
-  if (!is_filtered(int(cmd_id), opts.cmd_filter))
-    fprintf(stdout, " %2i: Command 0x%02X: First string length %u, \"%s\".", counter, cmd_id, l, s1.c_str());
+    for (size_t i = 12; i + 4 <= chunklen; i += 4)
+    {
+      float f;
+      memcpy(&f, buf + i, 4);
 
-  pos += l + 5;
+      if (i != 12) rec.put(json ? ',' : ' ');
+      if (!rec.put_fixed2(f)) rec.put(json ? "null" : "nan");
+    }
 
-  l = buf[pos];
-  if (len < l) return false;
+    rec.put(json ? "]}\n" : "\n");
+  }
 
-  std::string s2 = read2ByteString((const char*)buf + pos + 1, 2 * l);
+  /* The fields that every record starts with. */
+  void begin(unsigned int timecode, unsigned int block_count, unsigned int type, unsigned int player)
+  {
+    if (opts.export_format == Options::EXPORT_NDJSON)
+    {
+      rec.put("{\"file\":");
+      rec.put_json_string(filename);
+      rec.put(",\"timecode\":");
+      rec.put_uint(timecode);
+      rec.put(",\"chunk\":");
+      rec.put_uint(block_count);
+      rec.put(",\"type\":");
+      rec.put_uint(type);
+      rec.put(",\"player\":");
+      rec.put_uint(player);
+    }
+    else
+    {
+      rec.put_csv_field(filename);
+      rec.put(',');
+      rec.put_uint(timecode);
+      rec.put(',');
+      rec.put_uint(block_count);
+      rec.put(',');
+      rec.put_uint(type);
+      rec.put(',');
+      rec.put_uint(player);
+    }
+  }
 
-  pos += 2 * l + 2;
-  if (len < l) return false;
+  const Options & opts;
+  const char * filename;
+  RecordBuffer & rec;
+  unsigned int block;
+};
 
-  if (!is_filtered(int(cmd_id), opts.cmd_filter))
-    fprintf(stdout, " Second string length %u, \"%s\". Number: 0x%08X.\n", l, s2.c_str(), READ_UINT32LE(buf + pos));
+/* The --columns sink: every type-1 command and every type-2 chunk becomes a row of the
+ * column file, with the same filters and player numbers as --export.
+ */
+template <typename Game>
+struct ColumnSink : public NullSink
+{
+  ColumnSink(const Options & o, ColumnWriter & c) : opts(o), columns(c) { }
 
-  pos += 5;
+  void command(const command_event_t & ev)
+  {
+    if (ev.length == 0 || is_filtered(int(ev.cmd_id), opts.cmd_filter)) return;
 
-  return true;
-}
+    columns.add_row(ev.timecode, 1, uint8_t(Game::mangle_player(ev.player)), uint8_t(ev.cmd_id), ev.data, ev.length);
+  }
 
+  void player_chunk(unsigned int player_id, const unsigned char * buf, size_t chunklen,
+                    unsigned int timecode, unsigned int /* block_count */)
+  {
+    if (is_filtered(2, opts.type)) return;
+
+    columns.add_row(timecode, 2, uint8_t(player_id), 0, buf + 11, chunklen > 11 ? chunklen - 11 : 0);
+  }
+
+  const Options & opts;
+  ColumnWriter & columns;
+};
 
 
-command_map_t RA3_commands;
-command_map_t KW_commands;
-command_map_t TW_commands;
-command_names_t RA3_cmd_names;
-command_names_t KW_cmd_names;
-command_names_t TW_cmd_names;
 
 /* The type-1 chunk command info.
+ * The tables are indexed directly by the command byte and fixed at compile time.
  * Commands are either of fixed length (> 0), or of variable length.
  * Variable lengths commands that receive special treatment are set to 0,
- * while those that can be treated with parse_chunk1_varlen are set to -cmd_len_byte.
+ * while those that can be treated with varlen_command_length() are set to -cmd_len_byte.
+ * Commands we know nothing about are UNK (CMD_UNKNOWN).
  *
  * Popular cmd_len_byte values are 2 and 4. Consequently, what appears to be
  * a fixed-length commmand of length n may actually be a variable-length
  * command if (n - 4) or (n - 6) is divisible by 4.
  *
  * Fixed length commands which for which I couldn't find any such pattern
- * are marked with "// OK", meaning they are probably genuinely of fixed
- * length, and their length isn't actually part of the data.
+ * are listed after "// OK" in each row, meaning they are probably genuinely
+ * of fixed length, and their length isn't actually part of the data.
  *
  */
 
-void populate_command_map_TW(command_map_t & tw_commands, command_names_t & tw_cmd_names)
+#define UNK CMD_UNKNOWN
+
+extern constexpr command_table_t TW_commands =
+{
+  /*        0x0   0x1   0x2   0x3   0x4   0x5   0x6   0x7   0x8   0x9   0xA   0xB   0xC   0xD   0xE   0xF */
+  /* 0x00 */   -2,   -2,   -2,   -2,   -2,   -2,   -2,   -2,   -2,   -2,   -2,  UNK,   -2,   -2,  UNK,   -2,
+  /* 0x10 */   -2,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  -15,    0,   35,   28,  // OK: 0x1E, 0x1F
+  /* 0x20 */  UNK,   12,   -2,   26,   22,   17,   17,    0,  UNK,  UNK,   -2,   -2,   -2,   -2,  UNK,  UNK,  // OK: 0x21, 0x23
+  /* 0x30 */  UNK,  UNK,   21,   21,   16,  UNK,  UNK,  UNK,  UNK,   -2,   -2,   21,   16,   16,   16,  UNK,  // OK: 0x3C
+  /* 0x40 */  UNK,  UNK,   -2,   -2,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0x50 */  UNK,   16,  UNK,  UNK,  UNK,  UNK,  UNK,   20,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  // OK: 0x57
+  /* 0x60 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,   -2,   -2,  UNK,  UNK,  UNK,   -2,  UNK,  UNK,
+  /* 0x70 */   29,  UNK,  UNK,  UNK,   -2,   -2,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,   -2,  UNK,    8,
+  /* 0x80 */  UNK,    0,   45, 1049,   16,   -2,   16,   10,   -2,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  // OK: 0x84, 0x86
+  /* 0x90 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xA0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xB0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xC0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xD0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xE0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xF0 */  UNK,  UNK,  UNK,  UNK,  UNK,   -4,   -4,  UNK,   -4,   -2,   -2,   -2,   -2,   -2,   -2,   -2
+};
+
+extern constexpr command_name_table_t TW_cmd_names =
+{
+  /* 0x00 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x10 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x20 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x30 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x40 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x50 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x57 */ "30s heartbeat",
+  /* 0x58 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x60 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x70 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x80 */ NULL, NULL, NULL, NULL, NULL,
+  /* 0x85 */ "'scroll'",
+  /* 0x86 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x90 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xA0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xB0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xC0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xD0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xE0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xF0 */ NULL, NULL, NULL, NULL, NULL,
+  /* 0xF5 */ "drag selection box and/or select units/structures",
+  /* 0xF6 */ NULL, NULL,
+  /* 0xF8 */ "left click",
+  /* 0xF9 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+extern constexpr command_table_t KW_commands =
+{
+  /*        0x0   0x1   0x2   0x3   0x4   0x5   0x6   0x7   0x8   0x9   0xA   0xB   0xC   0xD   0xE   0xF */
+  /* 0x00 */  UNK,   -2,   -2,   -2,   -2,   -2,   -2,   -2,   -2,   -2,  UNK,   -2,   -2,   -2,  UNK,   -2,
+  /* 0x10 */   -2,   -2,   -2,  UNK,  UNK,  UNK,  UNK,   -2,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0x20 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  -15,  -34,    0,   28,  UNK,  -11,   17,    0,   22,   17,
+  /* 0x30 */   17,    0,  UNK,  UNK,    8,   12,   13,  UNK,  UNK,  UNK,  UNK,  UNK,   21,   21,   16,  UNK,
+  /* 0x40 */  UNK,  UNK,  UNK,   12,    8,   21,   16,   16,   16,  UNK,  UNK,  UNK,   -2,   -2,  UNK,  UNK,
+  /* 0x50 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,   16,  UNK,  UNK,  UNK,  UNK,
+  /* 0x60 */  UNK,   20,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0x70 */  UNK,  UNK,   -2,   -2,  UNK,  UNK,  UNK,    3,  UNK,  UNK,   29,  UNK,  UNK,  UNK,   12,   12,
+  /* 0x80 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,    8,  UNK,    8,  UNK,    0,   45, 1049,   16,   40,
+  /* 0x90 */   16,   10,   -2,   -2,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xA0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xB0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xC0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xD0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xE0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xF0 */  UNK,  UNK,  UNK,  UNK,  UNK,   -4,   -4,  UNK,   -4,   -2,   -2,   -2,   -2,   -2,   -2,   -2
+};
+
+extern constexpr command_name_table_t KW_cmd_names =
 {
-  tw_commands[0x1E] = 35; // OK
-  tw_commands[0x1F] = 28; // OK
-  tw_commands[0x21] = 12; // OK
-  tw_commands[0x23] = 26; // OK
-  tw_commands[0x24] = 22;
-  tw_commands[0x25] = 17;
-  tw_commands[0x26] = 17;
-  tw_commands[0x32] = 21;
-  tw_commands[0x33] = 21;
-  tw_commands[0x34] = 16;
-  tw_commands[0x3B] = 21;
-  tw_commands[0x3C] = 16; // OK
-  tw_commands[0x3D] = 16;
-  tw_commands[0x3E] = 16;
-  tw_commands[0x51] = 16;
-  tw_commands[0x57] = 20; // OK
-  tw_commands[0x70] = 29;
-  tw_commands[0x7F] = 8;
-  tw_commands[0x82] = 45;
-  tw_commands[0x83] = 1049;
-  tw_commands[0x84] = 16; // OK
-  tw_commands[0x86] = 16; // OK
-  tw_commands[0x87] = 10;
-
-  tw_commands[0x1D] = 0;
-  tw_commands[0x27] = 0;
-  tw_commands[0x81] = 0;
-
-  tw_commands[0x00] = -2;
-  tw_commands[0x01] = -2;
-  tw_commands[0x02] = -2;
-  tw_commands[0x03] = -2;
-  tw_commands[0x04] = -2;
-  tw_commands[0x05] = -2;
-  tw_commands[0x06] = -2;
-  tw_commands[0x07] = -2;
-  tw_commands[0x08] = -2;
-  tw_commands[0x09] = -2;
-  tw_commands[0x0A] = -2;
-  tw_commands[0x0C] = -2;
-  tw_commands[0x0D] = -2;
-  tw_commands[0x0F] = -2;
-  tw_commands[0x10] = -2;
-  tw_commands[0x1C] = -15;
-  tw_commands[0x22] = -2;
-  tw_commands[0x2A] = -2;
-  tw_commands[0x2B] = -2;
-  tw_commands[0x2C] = -2;
-  tw_commands[0x2D] = -2;
-  tw_commands[0x39] = -2;
-  tw_commands[0x3A] = -2;
-  tw_commands[0x42] = -2;
-  tw_commands[0x43] = -2;
-  tw_commands[0x68] = -2;
-  tw_commands[0x69] = -2;
-  tw_commands[0x6D] = -2;
-  tw_commands[0x74] = -2;
-  tw_commands[0x75] = -2;
-  tw_commands[0x7D] = -2;
-  tw_commands[0x85] = -2;
-  tw_commands[0x88] = -2;
-  tw_commands[0xF5] = -4;
-  tw_commands[0xF6] = -4;
-  tw_commands[0xF8] = -4;
-  tw_commands[0xF9] = -2;
-  tw_commands[0xFA] = -2;
-  tw_commands[0xFB] = -2;
-  tw_commands[0xFC] = -2;
-  tw_commands[0xFD] = -2;
-  tw_commands[0xFE] = -2;
-  tw_commands[0xFF] = -2;
-
-  tw_cmd_names[0x57] = "30s heartbeat";
-  tw_cmd_names[0x85] = "'scroll'";
-  tw_cmd_names[0xF5] = "drag selection box and/or select units/structures";
-  tw_cmd_names[0xF8] = "left click";
+  /* 0x00 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x10 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x20 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x30 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x40 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x50 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x60 */ NULL,
+  /* 0x61 */ "30s heartbeat",
+  /* 0x62 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x70 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x80 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x8F */ "'scroll'",
+  /* 0x90 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xA0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xB0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xC0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xD0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xE0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xF0 */ NULL, NULL, NULL, NULL, NULL,
+  /* 0xF5 */ "drag selection box and/or select units/structures",
+  /* 0xF6 */ NULL, NULL,
+  /* 0xF8 */ "left click",
+  /* 0xF9 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+/* RA3 0x4D may be another special-length command (0). */
+extern constexpr command_table_t RA3_commands =
+{
+  /*        0x0   0x1   0x2   0x3   0x4   0x5   0x6   0x7   0x8   0x9   0xA   0xB   0xC   0xD   0xE   0xF */
+  /* 0x00 */   45,    0,    0,   17,   17,   20,   20,   17,   17,   35,   -2,  UNK,    0,   -2,   -2,   16,  // OK: 0x05, 0x06
+  /* 0x10 */    0,  UNK,   -2,  UNK,   16,   16,   16,  UNK,  UNK,  UNK,   -2,   -2,  UNK,  UNK,  UNK,  UNK,  // OK: 0x14, 0x15, 0x16
+  /* 0x20 */  UNK,   20,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,   -2,   -2,   -2,  UNK,   29,  UNK,   -2,   -2,  // OK: 0x21, 0x2C
+  /* 0x30 */  UNK,  UNK,   53,    0,   45, 1049,   16,   -2,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  // OK: 0x36
+  /* 0x40 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,   -2,   -2,  UNK,  UNK,    0,   -2,  UNK,   -2,  UNK,
+  /* 0x50 */  UNK,  UNK,   -2,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,   11,
+  /* 0x60 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0x70 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0x80 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0x90 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xA0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xB0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xC0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xD0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xE0 */  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,  UNK,
+  /* 0xF0 */  UNK,  UNK,  UNK,  UNK,  UNK,   -5,   -5,  UNK,   -4,   -2,   -7,   -2,   -2,   -7,  -15,  -34
+};
+
+extern constexpr command_name_table_t RA3_cmd_names =
+{
+  /* 0x00 */ NULL, NULL,
+  /* 0x02 */ "set rally point",
+  /* 0x03 */ "start/resume research upgrade",
+  /* 0x04 */ "pause/cancel research upgrade",
+  /* 0x05 */ "start/resume unit construction",
+  /* 0x06 */ "pause/cancel unit construction",
+  /* 0x07 */ "start/resume structure construction",
+  /* 0x08 */ "pause/cancel structure construction",
+  /* 0x09 */ "place structure",
+  /* 0x0A */ "sell structure",
+  /* 0x0B */ NULL,
+  /* 0x0C */ "ungarrison structure (?)",
+  /* 0x0D */ "attack",
+  /* 0x0E */ "force-fire",
+  /* 0x0F */ NULL,
+  /* 0x10 */ "garrison structure",
+  /* 0x11 */ NULL, NULL, NULL,
+  /* 0x14 */ "move unit",
+  /* 0x15 */ "attack-move unit",
+  /* 0x16 */ "force-move unit",
+  /* 0x17 */ NULL, NULL, NULL,
+  /* 0x1A */ "stop unit",
+  /* 0x1B */ NULL, NULL, NULL, NULL, NULL,
+  /* 0x20 */ NULL,
+  /* 0x21 */ "3s heartbeat",
+  /* 0x22 */ NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x28 */ "start repair structure",
+  /* 0x29 */ "stop repair structure",
+  /* 0x2A */ "'Q' select",
+  /* 0x2B */ NULL,
+  /* 0x2C */ "formation-move preview",
+  /* 0x2D */ NULL,
+  /* 0x2E */ "stance change",
+  /* 0x2F */ "waypoint/planning mode (?)",
+  /* 0x30 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x37 */ "'scroll'",
+  /* 0x38 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x40 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x4E */ "player power",
+  /* 0x4F */ NULL,
+  /* 0x50 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x60 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x70 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x80 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0x90 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xA0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xB0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xC0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xD0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xE0 */ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  /* 0xF0 */ NULL, NULL, NULL, NULL, NULL,
+  /* 0xF5 */ "drag selection box and/or select units/structures",
+  /* 0xF6 */ NULL, NULL,
+  /* 0xF8 */ "left click",
+  /* 0xF9 */ "unit ungarrisons structure (automatic event) (?)",
+  /* 0xFA */ "create group",
+  /* 0xFB */ "select group",
+  /* 0xFC */ NULL, NULL, NULL, NULL
+};
+
+#undef UNK
+
+/* The special-length type-1 commands of each game. */
+size_t TW_traits::special_length(const unsigned char * buf, size_t pos, size_t /* chunklen */)
+{
+  switch (buf[pos])
+  {
+  case 0x1D: return buf[pos + 30] == 0xFF ? 35 : 32 + 4 * (buf[pos + 30] + 1);
+  case 0x27: return buf[pos + 12] * 18 + 17;
+  case 0x81: return uuid_command_length(buf, pos);
+  default:   return 0;
+  }
 }
 
-void populate_command_map_KW(command_map_t & kw_commands, command_names_t & kw_cmd_names)
+size_t KW_traits::special_length(const unsigned char * buf, size_t pos, size_t /* chunklen */)
 {
-  kw_commands[0x01] = -2;
-  kw_commands[0x02] = -2;
-  kw_commands[0x03] = -2;
-  kw_commands[0x04] = -2;
-  kw_commands[0x05] = -2;
-  kw_commands[0x06] = -2;
-  kw_commands[0x07] = -2;
-  kw_commands[0x08] = -2;
-  kw_commands[0x09] = -2;
-  kw_commands[0x0B] = -2;
-  kw_commands[0x0C] = -2;
-  kw_commands[0x0D] = -2;
-  kw_commands[0x0F] = -2;
-  kw_commands[0x10] = -2;
-  kw_commands[0x11] = -2;
-  kw_commands[0x12] = -2;
-  kw_commands[0x17] = -2;
-
-  kw_commands[0x27] = -34;
-  kw_commands[0x29] = 28;
-  kw_commands[0x2B] = -11;
-  kw_commands[0x2C] = 17;
-  kw_commands[0x2E] = 22;
-  kw_commands[0x2F] = 17;
-  kw_commands[0x30] = 17;
-  kw_commands[0x34] = 8;
-  kw_commands[0x35] = 12;
-  kw_commands[0x36] = 13;
-  kw_commands[0x3C] = 21;
-  kw_commands[0x3E] = 16;
-  kw_commands[0x3D] = 21;
-  kw_commands[0x43] = 12;
-  kw_commands[0x44] = 8;
-  kw_commands[0x45] = 21;
-  kw_commands[0x46] = 16;
-  kw_commands[0x47] = 16;
-  kw_commands[0x48] = 16;
-  kw_commands[0x5B] = 16;
-  kw_commands[0x61] = 20;
-  kw_commands[0x72] = -2;
-  kw_commands[0x73] = -2;
-  kw_commands[0x77] = 3;
-  kw_commands[0x7A] = 29;
-  kw_commands[0x7E] = 12;
-  kw_commands[0x7F] = 12;
-  kw_commands[0x87] = 8;
-  kw_commands[0x89] = 8;
-  kw_commands[0x8C] = 45;
-  kw_commands[0x8D] = 1049;
-  kw_commands[0x8E] = 16;
-  kw_commands[0x8F] = 40;
-  kw_commands[0x90] = 16;
-  kw_commands[0x91] = 10;
-
-  kw_commands[0x28] = 0;
-  kw_commands[0x2D] = 0;
-  kw_commands[0x31] = 0;
-  kw_commands[0x8B] = 0;
-
-  kw_commands[0x26] = -15;
-  kw_commands[0x4C] = -2;
-  kw_commands[0x4D] = -2;
-  kw_commands[0x92] = -2;
-  kw_commands[0x93] = -2;
-  kw_commands[0xF5] = -4;
-  kw_commands[0xF6] = -4;
-  kw_commands[0xF8] = -4;
-  kw_commands[0xF9] = -2;
-  kw_commands[0xFA] = -2;
-  kw_commands[0xFB] = -2;
-  kw_commands[0xFC] = -2;
-  kw_commands[0xFD] = -2;
-  kw_commands[0xFE] = -2;
-  kw_commands[0xFF] = -2;
-
-  kw_cmd_names[0x61] = "30s heartbeat";
-  kw_cmd_names[0x8F] = "'scroll'";
-  kw_cmd_names[0xF5] = "drag selection box and/or select units/structures";
-  kw_cmd_names[0xF8] = "left click";
+  switch (buf[pos])
+  {
+  case 0x31: return buf[pos + 12] * 18 + 17;
+  case 0x28: return (buf[pos + 17] + 1) * 4 + 32;
+  case 0x2D: return buf[pos + 7] == 0xFF ? 8 : 26;
+  case 0x8B: return uuid_command_length(buf, pos);
+  default:   return 0;
+  }
 }
 
-void populate_command_map_RA3(command_map_t & ra3_commands, command_names_t & ra3_cmd_names)
+size_t RA3_traits::special_length(const unsigned char * buf, size_t pos, size_t /* chunklen */)
 {
-  ra3_commands[0x00] = 45;
-  ra3_commands[0x03] = 17;
-  ra3_commands[0x04] = 17;
-  ra3_commands[0x05] = 20; // OK
-  ra3_commands[0x06] = 20; // OK
-  ra3_commands[0x07] = 17;
-  ra3_commands[0x08] = 17;
-  ra3_commands[0x09] = 35;
-  ra3_commands[0x0F] = 16;
-  ra3_commands[0x14] = 16; // OK
-  ra3_commands[0x15] = 16; // OK
-  ra3_commands[0x16] = 16; // OK
-  ra3_commands[0x21] = 20; // OK
-  ra3_commands[0x2C] = 29; // OK
-  ra3_commands[0x32] = 53;
-  ra3_commands[0x34] = 45;
-  ra3_commands[0x35] = 1049;
-  ra3_commands[0x36] = 16; //OK
-  ra3_commands[0x5F] = 11;
-
-  ra3_commands[0x01] = 0;
-  ra3_commands[0x02] = 0;
-  ra3_commands[0x0C] = 0;
-  ra3_commands[0x10] = 0;
-  ra3_commands[0x33] = 0;
-  ra3_commands[0x4B] = 0;
-
-  //  ra3_commands[0x4D] = 0;
-
-  ra3_commands[0x0A] = -2;
-  ra3_commands[0x0D] = -2;
-  ra3_commands[0x0E] = -2;
-  ra3_commands[0x12] = -2;
-  ra3_commands[0x1A] = -2;
-  ra3_commands[0x1B] = -2;
-  ra3_commands[0x28] = -2;
-  ra3_commands[0x29] = -2;
-  ra3_commands[0x2A] = -2;
-  ra3_commands[0x2E] = -2;
-  ra3_commands[0x2F] = -2;
-  ra3_commands[0x37] = -2;
-  ra3_commands[0x47] = -2;
-  ra3_commands[0x48] = -2;
-  ra3_commands[0x4C] = -2;
-  ra3_commands[0x4E] = -2;
-  ra3_commands[0x52] = -2;
-  ra3_commands[0xF5] = -5;
-  ra3_commands[0xF6] = -5;
-  ra3_commands[0xF8] = -4;
-  ra3_commands[0xF9] = -2;
-  ra3_commands[0xFA] = -7;
-  ra3_commands[0xFB] = -2;
-  ra3_commands[0xFC] = -2;
-  ra3_commands[0xFD] = -7;
-  ra3_commands[0xFE] = -15;
-  ra3_commands[0xFF] = -34;
-
-  ra3_cmd_names[0x02] = "set rally point";
-  ra3_cmd_names[0x03] = "start/resume research upgrade";
-  ra3_cmd_names[0x04] = "pause/cancel research upgrade";
-  ra3_cmd_names[0x05] = "start/resume unit construction";
-  ra3_cmd_names[0x06] = "pause/cancel unit construction";
-  ra3_cmd_names[0x07] = "start/resume structure construction";
-  ra3_cmd_names[0x08] = "pause/cancel structure construction";
-  ra3_cmd_names[0x09] = "place structure";
-  ra3_cmd_names[0x0A] = "sell structure";
-
-  ra3_cmd_names[0x0C] = "ungarrison structure (?)";
-  ra3_cmd_names[0x0D] = "attack";
-  ra3_cmd_names[0x0E] = "force-fire";
-
-  ra3_cmd_names[0x10] = "garrison structure";
-
-  ra3_cmd_names[0x14] = "move unit";
-  ra3_cmd_names[0x15] = "attack-move unit";
-  ra3_cmd_names[0x16] = "force-move unit";
-  ra3_cmd_names[0x1A] = "stop unit";
-
-  ra3_cmd_names[0x21] = "3s heartbeat";
-
-  ra3_cmd_names[0x28] = "start repair structure";
-  ra3_cmd_names[0x29] = "stop repair structure";
-  ra3_cmd_names[0x2A] = "'Q' select";
-  ra3_cmd_names[0x2C] = "formation-move preview";
-  ra3_cmd_names[0x2E] = "stance change";
-  ra3_cmd_names[0x2F] = "waypoint/planning mode (?)";
-  ra3_cmd_names[0x37] = "'scroll'";
-  ra3_cmd_names[0x4E] = "player power";
-  ra3_cmd_names[0xF5] = "drag selection box and/or select units/structures";
-  ra3_cmd_names[0xF8] = "left click";
-  ra3_cmd_names[0xF9] = "unit ungarrisons structure (automatic event) (?)";
-  ra3_cmd_names[0xFA] = "create group";
-  ra3_cmd_names[0xFB] = "select group";
+  switch (buf[pos])
+  {
+  case 0x0C: return 4 * (buf[pos + 3] + 1) + 5;
+  case 0x01:
+    if (buf[pos + 2] == 0xFF) return 3;
+    if (buf[pos + 7] == 0xFF) return 8;
+    return 4 * (buf[pos + 17] + 1) + 32;
+  case 0x02: return (buf[pos + 24] + 1) * 2 + 26;
+  case 0x10: return buf[pos + 2] == 0x14 ? 12 : (buf[pos + 2] == 0x04 ? 13 : 99999); /* two possible lengths, 12 or 13 */
+  case 0x4B: return buf[pos + 2] == 0x04 ? 8 : (buf[pos + 2] == 0x07 ? 16 : 99999);  /* two possible lengths, 8 or 16 */
+  case 0x33: return uuid_command_length(buf, pos);
+  default:   return 0;
+  }
 }
 
-/* This helper function computes the player number 0, 1, 2, ... from
- * the player number in the type-1 chunk commands, 0x19, 0x1A, etc.
+/* The type-1 chunk decoder: splits the chunk into its commands and hands them to the sink.
+ * It only works out where each command ends, from the command tables and the special
+ * lengths; everything else is up to the sink. Problems with the data are reported on
+ * "out" straight away, and make it return false.
  */
-inline unsigned int mangle_player(unsigned int n, Options::GameType gametype)
+template <typename Game, typename Sink>
+bool decode_chunk1(const unsigned char * buf, size_t chunklen, unsigned int timecode, unsigned int block_count,
+                   Sink & sink, FILE * out)
 {
-  return n / 8 - (gametype == Options::GAME_RA3 ? 2 : 3);
-}
+  const int16_t * const commands = Game::commands();
+  const size_t ncommands = READ_UINT32LE(buf+1);
 
-bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen, unsigned int timecode,
-                unsigned char hsix, unsigned char hnumber1, std::ostream & audioout,
-                apm_1_map_t & player_1_apm, apm_2_map_t & player_2_apm,
-                apm_histo_map_t & player_indi_histo_apm, apm_histo_map_t & player_coal_histo_apm,
-                unsigned int block_count, Options::GameType gametype, const Options & opts)
-{
-      const command_map_t & commands = gametype == Options::GAME_TW ? TW_commands
-        : (gametype == Options::GAME_KW ? KW_commands : RA3_commands);
+  sink.chunk1_begin(buf, chunklen, timecode, block_count, ncommands);
 
-      // Chunk type 1
-      if (chunktype == 1 && buf[0] == 1 && buf[chunklen-1] == 0xFF && READ_UINT32LE(buf+chunklen) == 0)
+  command_event_t ev;
+  ev.timecode = timecode;
+
+  size_t pos = 5, counter;
+  bool ok = true;
+
+  /* The terminators of the chunk, for the commands of unknown length; found on first use. */
+  std::vector<uint32_t> terminators;
+  bool have_terminators = false;
+
+  for (counter = 1 ; pos < chunklen; counter++)
+  {
+    ev.counter    = counter;
+    ev.cmd_id     = buf[pos];
+    ev.player     = buf[pos + 1];
+    ev.table_len  = commands[ev.cmd_id];
+    ev.recognized = true;
+    ev.data       = buf + pos;
+    ev.length     = 0;
+
+    if (ev.table_len == CMD_UNKNOWN) // we are missing information!
+    {
+      fprintf(out, "Warning: Unknown command type: 0x%02X\n", ev.cmd_id);
+      sink.command(ev);
+      ok = false;
+      break;
+    }
+    else if (ev.table_len > 0)  // Fixed-length commands
+    {
+      if (size_t(ev.table_len) > chunklen - pos)
       {
-        if (is_filtered(1, opts.type)) return true;
+        fprintf(out, "PANIC: fixed command length (%u) for command (0x%02X) runs past the end of the chunk!\n",
+                ev.table_len, ev.cmd_id);
+        sink.command(ev);
+        ok = false;
+        break;
+      }
+      if (buf[pos + ev.table_len - 1] != 0xFF)
+      {
+        fprintf(out,
+                "PANIC: fixed command length (%u) for command (0x%02X) does not lead to terminator, but to 0x%02X!\n",
+                ev.table_len, ev.cmd_id, buf[pos + ev.table_len - 1]);
+        sink.command(ev);
+        ok = false;
+        break;
+      }
+      ev.length = ev.table_len;
+    }
+    else if (ev.table_len < 0)  // variable-length commands
+    {
+      ev.length = varlen_command_length(buf, pos, chunklen, -ev.table_len);
+    }
+    else // special-length commands
+    {
+      ev.length = Game::special_length(buf, pos, chunklen);
 
-        const size_t ncommands = READ_UINT32LE(buf+1);
+      if (ev.length == 0)
+      {
+        fprintf(out, "Warning: Unrecognized variable-length command.\n");
+        if (!have_terminators) { find_terminators(buf, chunklen, 0, terminators); have_terminators = true; }
+        const std::vector<uint32_t>::const_iterator end = std::lower_bound(terminators.begin(), terminators.end(), uint32_t(pos));
+        if (end == terminators.end()) { fprintf(out, "Panic: could not find terminator!\n"); ok = false; }
+        ev.length = end != terminators.end() ? *end + 1 - pos : chunklen - pos;
+        ev.recognized = false;
+      }
+    }
 
-        if (!opts.apm && opts.dumpchunkswithraw)
-        {
-          fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Number of commands: %u."
-                  //" Payload:"
-                  "\n  Dissecting chunk commands.\n",
-                  timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, chunktype, ncommands);
-        }
+    /* Commands never reach into the next chunk; the sinks may read all of ev.length. */
+    if (ev.length > chunklen - pos)
+    {
+      fprintf(out, "PANIC: command 0x%02X (%u bytes) runs past the end of the chunk!\n", ev.cmd_id, unsigned(ev.length));
+      ev.length = 0;
+      sink.command(ev);
+      ok = false;
+      break;
+    }
 
-        /* We've completed the dissector, no more need for the raw dump! */
-        if (opts.dumpchunkswithraw)
-          hexdump(stdout, buf+5, chunklen-5, "  ");
+    sink.command(ev);
 
-        /* This next line was used during the learning phase to gather command statistics. */
-        //if (ncommands == 1) fprintf(stdout, "MASTERPLAN 0x%02X %u\n", (int)buf[5], chunklen-5);
+    pos += ev.length;
+    if (pos >= chunklen) break;
+  }
 
-        size_t pos = 5, opos = pos, counter;
+  sink.chunk1_end();
 
-        for (counter = 1 ; ; counter++)
-        {
-          const unsigned int cmd_id = buf[opos];
-          const unsigned int player_id = buf[opos + 1];
-
-          player_indi_histo_apm[player_id][cmd_id].insert(timecode);;
-          player_coal_histo_apm[mangle_player(player_id, gametype)][cmd_id].insert(timecode);
-          ++player_1_apm[mangle_player(player_id, gametype)];
-
-          command_map_t::const_iterator c = commands.find(cmd_id);
-
-          if      (c != commands.end() && c->second > 0)  // Fixed-length commands
-          {
-            if (!parse_chunk1_fixlen(buf, pos, opos, cmd_id, counter, c->second, opts)) break;
-          }
-          else if (c != commands.end() && c->second < 0)  // variable-length commands
-          {
-            if (!parse_chunk1_varlen(buf, pos, cmd_id, counter, chunklen, -c->second, opts)) break;
-          }
-          else if (c != commands.end() && c->second <= 0) // special-length commands
-          {
-            char s[10] = { ' ', ' ', ' ', ' ', ' ', 0 };
-
-            if (gametype == Options::GAME_RA3)
-            {
-              if (cmd_id == 0x0C)
-              {
-                size_t l = buf[pos + 3] + 1;
-                pos += 4 * l + 5;
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                {
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, pos - opos);
-                }
-              }
-              else if (cmd_id == 0x01)
-              {
-                if (buf[pos + 2] == 0xFF)
-                {
-                  pos += 3;
-                }
-                else if (buf[pos + 7] == 0xFF)
-                {
-                  pos += 8;
-                }
-                else
-                {
-                  const size_t l = buf[pos + 17] + 1;
-                  pos += 4 * l + 32;
-                }
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                {
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, pos - opos);
-                }
-              }
-              else if (cmd_id == 0x02)
-              {
-                const size_t l = (buf[pos + 24] + 1) * 2 + 26;
-                pos += l;
-
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                {
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, pos - opos);
-                }
-              }
-              else if (cmd_id == 0x10) /* 0x10 is special, it has two possible lengths, 12 or 13 */
-              {
-                const size_t l = buf[pos + 2] == 0x14 ? 12 : (buf[pos + 2] == 0x04 ? 13 : 99999);
-
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, l);
-
-                pos += l;
-              }
-              else if (cmd_id == 0x4B) /* 0x4B is special, it has two possible lengths, 8 or 16 */
-              {
-                const size_t l = buf[pos + 2] == 0x04 ? 8 : (buf[pos + 2] == 0x07 ? 16 : 99999);
-
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, l);
-
-                pos += l;
-              }
-              else if (cmd_id == 0x33)
-              {
-                parse_chunk1_uuid(buf, pos, chunklen, cmd_id, counter, opts);
-              }
-              else
-              {
-                fprintf(stdout, "Warning: Unrecognized variable-length command.\n");
-                while (buf[pos] != 0xFF && pos < chunklen) pos++;
-                if (buf[pos] != 0xFF) fprintf(stdout, "Panic: could not find terminator!\n");
-                pos++;
-                sprintf(s, " %2i: ", counter);
-              }
-            }
-            else if (gametype == Options::GAME_KW)
-            {
-              if (cmd_id == 0x31)
-              {
-                size_t l = buf[pos + 12];
-                pos += l * 18 + 17;
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                {
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, pos - opos);
-                }
-              }
-              else if (cmd_id == 0x28)
-              {
-                pos += (buf[pos + 17] + 1) * 4 + 32;
-
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                {
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, pos - opos);
-                }
-
-              }
-              else if (cmd_id == 0x2D)
-              {
-                pos += buf[pos + 7] == 0xFF ? 8 : 26;
-
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                {
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, pos - opos);
-                }
-
-              }
-              else if (cmd_id == 0x8B)
-              {
-                parse_chunk1_uuid(buf, pos, chunklen, cmd_id, counter, opts);
-              }
-              else
-              {
-                fprintf(stdout, "Warning: Unrecognized variable-length command.\n");
-                while (buf[pos] != 0xFF && pos < chunklen) pos++;
-                if (buf[pos] != 0xFF) fprintf(stdout, "Panic: could not find terminator!\n");
-                pos++;
-                sprintf(s, " %2i: ", counter);
-              }
-            }
-            else if (gametype == Options::GAME_TW)
-            {
-              if (cmd_id == 0x1D)
-              {
-                if (buf[pos + 30] == 0xFF)
-                {
-                  pos += 35;
-                }
-                else
-                {
-                  pos += 32 + 4 * (buf[pos + 30] + 1);
-                }
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                {
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, pos - opos);
-                }
-              }
-              else if (cmd_id == 0x27)
-              {
-                size_t l = buf[pos + 12];
-                pos += l * 18 + 17;
-                if (!is_filtered(int(cmd_id), opts.cmd_filter))
-                {
-                  fprintf(stdout, " %2i: Command 0x%02X, special length %u.\n", counter, cmd_id, pos - opos);
-                }
-              }
-              else if (cmd_id == 0x81)
-              {
-                parse_chunk1_uuid(buf, pos, chunklen, cmd_id, counter, opts);
-              }
-              else
-              {
-                fprintf(stdout, "Warning: Unrecognized variable-length command.\n");
-                while (buf[pos] != 0xFF && pos < chunklen) pos++;
-                if (buf[pos] != 0xFF) fprintf(stdout, "Panic: could not find terminator!\n");
-                pos++;
-                sprintf(s, " %2i: ", counter);
-              }
-            }
-
-            if (!is_filtered(int(cmd_id), opts.cmd_filter))
-            {
-              hexdump(stdout, buf + opos, pos - opos, s);
-            }
-          }
-          else if (c == commands.end()) // we are missing information!
-          {
-            fprintf(stdout, "Warning: Unknown command type: 0x%02X\n", cmd_id);
-            break;
-          }
-          else // obsolete, this code just searches naively for an 0xFF "terminator"
-          {
-            while (buf[pos] != 0xFF && pos < chunklen) pos++;
-
-            if (buf[pos] != 0xFF) fprintf(stdout, "Panic: could not find terminator!\n");
-
-            char s[10] = { 0 };
-            pos++;
-            sprintf(s, " %2i: ", counter);
-
-            hexdump(stdout, buf + opos, pos - opos, s);
-          }
-
-          opos = pos;
-          if (pos == chunklen) break;
-        }
+  if (counter > ncommands) { fprintf(out, "Panic: Too many commands dissected!\n\n"); ok = false; }
+
+  return ok;
+}
+
+/* The chunk dissector, instantiated once per game (see TW_traits etc.) and per sink. */
+template <typename Game, typename Sink>
+bool dumpchunks_game(const unsigned char * buf, char chunktype, unsigned int chunklen, unsigned int timecode,
+                     unsigned char hsix, unsigned char hnumber1, std::ostream & audioout,
+                     Sink & sink, unsigned int block_count, const Options & opts,
+                     FILE * out, FILE * err)
+{
+      /* With -p, -V, --follow, --export and --columns, only the sink gets to see anything. */
+      const bool quiet = opts.apm || opts.validate || opts.follow || opts.export_format != Options::EXPORT_NONE || opts.columnsfn != NULL;
 
-        if (!opts.apm && opts.dumpchunkswithraw) fprintf(stdout, "\n");
+      // Chunk type 1
+      if (chunktype == 1 && chunklen > 5 && buf[0] == 1 && buf[chunklen-1] == 0xFF && READ_UINT32LE(buf+chunklen) == 0)
+      {
+        if (is_filtered(1, opts.type)) return true;
 
-        if (counter > ncommands) { fprintf(stdout, "Panic: Too many commands dissected!\n\n"); }
+        if (!decode_chunk1<Game>(buf, chunklen, timecode, block_count, sink, out) && opts.validate) return false;
       }
 
       // Chunk type 2
       else if ((chunktype == 2 && buf[0] == 1 && buf[1] == 0 && READ_UINT32LE(buf+7) == timecode && READ_UINT32LE(buf+chunklen) == 0) &&
-               ((buf[6] == 0x0F && gametype == Options::GAME_RA3) || buf[6] == 0x0E))
+               ((buf[6] == 0x0F && Game::game == Options::GAME_RA3) || buf[6] == 0x0E))
       {
         const unsigned int player_id = READ_UINT32LE(buf + 2);
 
-        if (opts.apm)
-        {
-          // Counters: 0 - heartbeat, 1 - other 40 byte, 2 - 24 byte
-
-          if (chunklen == 40 && (timecode % 15 == 0 || timecode == 1)) player_2_apm[player_id].counter[0]++;
-          else if (chunklen == 40) player_2_apm[player_id].counter[1]++;
-          else if (chunklen == 24) player_2_apm[player_id].counter[2]++;
-          else                     player_2_apm[player_id].counter[3]++;
-        }
+        sink.player_chunk(player_id, buf, chunklen, timecode, block_count);
 
         if (is_filtered(2, opts.type)) return true;
 
-        if (opts.type.count(2) != 0 && opts.filter_heartbeat == 1 && timecode % 15 && timecode != 1) return true;
-        if (opts.type.count(2) != 0 && opts.filter_heartbeat == 0 && (timecode % 15 == 0 || timecode == 1)) return true;
+        if (heartbeat_filtered(timecode, opts)) return true;
 
-        if (!opts.apm)
+        if (!quiet)
         {
-          fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Number (Player ID?): %u. Payload:\n",
+          fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Number (Player ID?): %u. Payload:\n",
                   timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, chunktype, player_id);
 
           if (opts.dumpchunkswithraw)
-            hexdump(stdout, buf+11, chunklen-11, "  ");
+            hexdump(out, buf+11, chunklen-11, "  ");
 
-          fprintf(stdout, "  As floats:");
+          fprintf(out, "  As floats:");
           for (size_t i = 12; i + 4 <= chunklen; i += 4)
-            fprintf(stdout, " %7.2f", *reinterpret_cast<const float*>(buf + i));
-          fprintf(stdout, "\n\n");
+            fprintf(out, " %7.2f", *reinterpret_cast<const float*>(buf + i));
+          fprintf(out, "\n\n");
         }
       }
 
@@ -908,7 +1006,7 @@ bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen
       {
         if (opts.dumpaudio && audioout)
         {
-          fprintf(stderr, "  writing audio chunk 0x%02X%02X (length: %2u bytes vs. %2u)...\n", buf[11], buf[12], READ_UINT16LE(buf[13], buf[14]), chunklen-15);
+          fprintf(err, "  writing audio chunk 0x%02X%02X (length: %2u bytes vs. %2u)...\n", buf[11], buf[12], READ_UINT16LE(buf[13], buf[14]), chunklen-15);
 
           if(READ_UINT16LE(buf[13], buf[14]) != chunklen-15)
             throw std::length_error("Unexpected audio track chunk.");
@@ -918,12 +1016,12 @@ bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen
 
         if (is_filtered(3, opts.type)) return true;
 
-        if (!opts.apm)
+        if (!quiet)
         {
-          fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Number (Player ID?): %u. Audio counter: %u. Payload:\n",
-                  timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, chunktype, READ_UINT32LE(buf+2), READ_UINT16LE(buf+11, buf+12));
-          hexdump(stdout, buf+11, chunklen-11, "  ");
-          fprintf(stdout, "\n");
+          fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Number (Player ID?): %u. Audio counter: %u. Payload:\n",
+                  timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, chunktype, READ_UINT32LE(buf+2), READ_UINT16LE(buf[11], buf[12]));
+          hexdump(out, buf+11, chunklen-11, "  ");
+          fprintf(out, "\n");
         }
       }
 
@@ -932,9 +1030,9 @@ bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen
       {
         if (is_filtered(3, opts.type)) return true;
 
-        if (!opts.apm)
+        if (!quiet)
         {
-          fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Empty chunk.\n\n",
+          fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Empty chunk.\n\n",
                   timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, chunktype);
         }
       }
@@ -945,12 +1043,12 @@ bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen
       {
         if (is_filtered(4, opts.type)) return true;
 
-        if (!opts.apm)
+        if (!quiet)
         {
-          fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Number (Player ID?): %u. Payload:\n",
+          fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Number (Player ID?): %u. Payload:\n",
                   timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, chunktype, READ_UINT32LE(buf+2));
-          hexdump(stdout, buf+11, chunklen-11, "  ");
-          fprintf(stdout, "\n");
+          hexdump(out, buf+11, chunklen-11, "  ");
+          fprintf(out, "\n");
         }
       }
 
@@ -959,9 +1057,9 @@ bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen
       {
         if (is_filtered(4, opts.type)) return true;
 
-        if (!opts.apm)
+        if (!quiet)
         {
-          fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Empty chunk.\n\n",
+          fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Empty chunk.\n\n",
                   timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, chunktype);
         }
       }
@@ -971,9 +1069,9 @@ bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen
       {
         if (is_filtered(1, opts.type)) return true;
 
-        if (!opts.apm)
+        if (!quiet)
         {
-          fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Empty chunk (skirmish only).\n\n",
+          fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %u. Empty chunk (skirmish only).\n\n",
                   timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, chunktype);
         }
       }
@@ -983,25 +1081,188 @@ bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen
       {
         if (is_filtered(-2, opts.type)) return true;
 
-        if (!opts.apm)
+        if (!quiet)
         {
-          fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %d. Raw data:\n",
+          fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %d. Raw data:\n",
                   timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, (int)(chunktype));
-          hexdump(stdout, buf, chunklen, "  ");
-          fprintf(stdout, "\n");
+          hexdump(out, buf, chunklen, "  ");
+          fprintf(out, "\n");
         }
       }
 
       // Otherwise: Panic!
       else
       {
-        fprintf(stderr, "\n************** Warning: Unexpected chunk data!\n");
-        fprintf(stdout, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %d. Raw data:\n",
+        fprintf(err, "\n************** Warning: Unexpected chunk data!\n");
+        fprintf(out, "Chunk number 0x%08X (timecode: %s, count %u, length: %u): Type: %d. Raw data:\n",
                 timecode, timecode_to_string(timecode).c_str(), block_count, chunklen, (int)(chunktype));
-        hexdump(stdout, buf, chunklen+4, "XYZZY   ");
-        fprintf(stdout, "\n");
+        hexdump(out, buf, chunklen+4, "XYZZY   ");
+        fprintf(out, "\n");
 
         return false;
       }
       return true;
 }
+
+/* Picks the sinks for the options: the APM statistics for -p, none at all for -V (so
+ * the type-1 chunks are only split into commands), the text dump otherwise, and both
+ * APM and text for -p -C, which also dumps the raw type-1 chunks.
+ */
+template <typename Game>
+bool dumpchunks_with_sinks(const unsigned char * buf, char chunktype, unsigned int chunklen, unsigned int timecode,
+                           unsigned char hsix, unsigned char hnumber1, std::ostream & audioout,
+                           apm_2_map_t & player_2_apm, ApmHistogram & player_histo_apm,
+                           unsigned int block_count, const Options & opts,
+                           FILE * out, FILE * err)
+{
+  TextSink<Game> text(opts, out);
+
+  if (!opts.apm && opts.validate)
+  {
+    NullSink none;
+    return dumpchunks_game<Game>(buf, chunktype, chunklen, timecode, hsix, hnumber1, audioout, none, block_count, opts, out, err);
+  }
+
+  if (!opts.apm)
+    return dumpchunks_game<Game>(buf, chunktype, chunklen, timecode, hsix, hnumber1, audioout, text, block_count, opts, out, err);
+
+  ApmSink apm(player_histo_apm, player_2_apm);
+
+  if (!opts.dumpchunkswithraw)
+    return dumpchunks_game<Game>(buf, chunktype, chunklen, timecode, hsix, hnumber1, audioout, apm, block_count, opts, out, err);
+
+  SinkPair<ApmSink, TextSink<Game> > both(apm, text);
+  return dumpchunks_game<Game>(buf, chunktype, chunklen, timecode, hsix, hnumber1, audioout, both, block_count, opts, out, err);
+}
+
+bool dumpchunks(const unsigned char * buf, char chunktype, unsigned int chunklen, unsigned int timecode,
+                unsigned char hsix, unsigned char hnumber1, std::ostream & audioout,
+                apm_2_map_t & player_2_apm, ApmHistogram & player_histo_apm,
+                unsigned int block_count, Options::GameType gametype, const Options & opts,
+                FILE * out, FILE * err)
+{
+  switch (gametype)
+  {
+  case Options::GAME_TW:
+    return dumpchunks_with_sinks<TW_traits>(buf, chunktype, chunklen, timecode, hsix, hnumber1, audioout,
+                                            player_2_apm, player_histo_apm, block_count, opts, out, err);
+  case Options::GAME_KW:
+    return dumpchunks_with_sinks<KW_traits>(buf, chunktype, chunklen, timecode, hsix, hnumber1, audioout,
+                                            player_2_apm, player_histo_apm, block_count, opts, out, err);
+  default:
+    return dumpchunks_with_sinks<RA3_traits>(buf, chunktype, chunklen, timecode, hsix, hnumber1, audioout,
+                                             player_2_apm, player_histo_apm, block_count, opts, out, err);
+  }
+}
+
+/* Walks the chunks of a mapped replay through the dissector into a sink, for --export and
+ * --columns. The dissector's own diagnostics go to "err".
+ */
+template <typename Game, typename Sink>
+bool sink_chunks_game(const MappedFile & file, const replay_header_t & header, const char * filename,
+                      const Options & opts, Sink & sink, FILE * err)
+{
+  std::ofstream noaudio;
+  ChunkReader chunks(file, header.firstchunk);
+  chunk_view_t chunk;
+  ChunkStatus status;
+  bool ok = true;
+
+  for (unsigned int block_count = 0; (status = chunks.next(chunk)) == CHUNK_OK; ++block_count)
+  {
+    if (chunk.timecode < opts.from_tc) continue;
+    if (chunk.timecode > opts.to_tc) break;
+
+    if (chunk.length > 10000)
+    {
+      fprintf(err, "%s: chunk %u is too long (%u bytes).\n", filename, block_count, chunk.length);
+      return false;
+    }
+
+    if (!dumpchunks_game<Game>(chunk.data, chunk.type, chunk.length, chunk.timecode, header.six, header.number1,
+                               noaudio, sink, block_count, opts, err, err)) ok = false;
+  }
+
+  if (status == CHUNK_TRUNCATED)
+  {
+    fprintf(err, "%s: the replay breaks off at offset %u.\n", filename, unsigned(chunk.offset));
+    return false;
+  }
+
+  return ok;
+}
+
+/* The --export mode: streams the records to "out", which only ever holds records. */
+template <typename Game>
+bool export_chunks_game(const MappedFile & file, const replay_header_t & header, const char * filename,
+                        const Options & opts, FILE * out, FILE * err)
+{
+  RecordBuffer rec(out);
+  ExportSink<Game> sink(opts, filename, rec);
+  return sink_chunks_game<Game>(file, header, filename, opts, sink, err);
+}
+
+bool export_chunks(const MappedFile & file, const replay_header_t & header, const char * filename,
+                   const Options & opts, FILE * out, FILE * err)
+{
+  switch (header.gametype)
+  {
+  case Options::GAME_TW:  return export_chunks_game<TW_traits>(file, header, filename, opts, out, err);
+  case Options::GAME_KW:  return export_chunks_game<KW_traits>(file, header, filename, opts, out, err);
+  default:                return export_chunks_game<RA3_traits>(file, header, filename, opts, out, err);
+  }
+}
+
+/* The length of a replay as -p reports it: the final time code in the footer, or
+ * that of the last complete chunk if there is no footer.
+ */
+uint32_t replay_length(const MappedFile & file, const replay_header_t & header)
+{
+  replay_footer_t footer;
+  size_t lastgood;
+
+  if (parse_replay_footer(file.data(), file.size(), header.gametype, footer)) return footer.final_timecode;
+  find_last_chunk(file, header.firstchunk, lastgood);
+  return lastgood ? READ_UINT32LE(file.data() + lastgood) : 0;
+}
+
+/* The --columns mode: adds the replay's rows to the column file. */
+template <typename Game>
+bool column_chunks_game(const MappedFile & file, const replay_header_t & header, const char * filename,
+                        const Options & opts, ColumnWriter & columns, FILE * err)
+{
+  ColumnSink<Game> sink(opts, columns);
+  columns.add_file(filename, header.gametype, replay_length(file, header));
+  return sink_chunks_game<Game>(file, header, filename, opts, sink, err);
+}
+
+bool column_chunks(const MappedFile & file, const replay_header_t & header, const char * filename,
+                   const Options & opts, ColumnWriter & columns, FILE * err)
+{
+  switch (header.gametype)
+  {
+  case Options::GAME_TW:  return column_chunks_game<TW_traits>(file, header, filename, opts, columns, err);
+  case Options::GAME_KW:  return column_chunks_game<KW_traits>(file, header, filename, opts, columns, err);
+  default:                return column_chunks_game<RA3_traits>(file, header, filename, opts, columns, err);
+  }
+}
+
+/* --follow: one more chunk into the running APM counters. */
+bool live_apm_chunk(const chunk_view_t & chunk, unsigned int block_count, unsigned char hsix, unsigned char hnumber1,
+                    LiveApmSink & live, const Options & opts, FILE * err)
+{
+  std::ofstream noaudio;
+
+  switch (live.gametype)
+  {
+  case Options::GAME_TW:
+    return dumpchunks_game<TW_traits>(chunk.data, chunk.type, chunk.length, chunk.timecode, hsix, hnumber1,
+                                      noaudio, live, block_count, opts, err, err);
+  case Options::GAME_KW:
+    return dumpchunks_game<KW_traits>(chunk.data, chunk.type, chunk.length, chunk.timecode, hsix, hnumber1,
+                                      noaudio, live, block_count, opts, err, err);
+  default:
+    return dumpchunks_game<RA3_traits>(chunk.data, chunk.type, chunk.length, chunk.timecode, hsix, hnumber1,
+                                       noaudio, live, block_count, opts, err, err);
+  }
+}
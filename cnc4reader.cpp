@@ -39,23 +39,23 @@ int main(int argc, char * argv[])
 
   std::cerr << "Opening file \"" << argv[1] << "... ";
 
-  std::ifstream infile(argv[1], std::fstream::binary);
+  /* The file is mapped once: the header is read from the mapping, the chunks are walked by the ReplayStream. */
+  std::unique_ptr<ReplayStream> replay = open_replay(argv[1]);
+
+  if (!replay || replay->format() != REPLAY_CNC4) { std::cerr << "Not a good C&C4 replay file." << std::endl; return 0; }
+  std::cerr << "OK!" << std::endl << std::endl;
+
+  MemoryIStream infile(replay->file());
 
   uint32_t N, Nlast = 0;
-  uint16_t L, S;
-  char magic[11], timeout[200], matchbuf[1024], player_who_saved;
+  char timeout[200], matchbuf[1024], player_who_saved;
   std::vector<std::string> player_names;
   date_text_t datetime;
 
-  READ(infile, N);
-  READ(infile, magic);
-
-  if (N != 7 || std::strncmp(magic, "CnC4RPLCnC4", 11)) { std::cerr << "Not a good C&C4 replay file." << std::endl; return 0; }
-  std::cerr << "OK!" << std::endl << std::endl;
-
   infile.seekg(0x21, std::fstream::beg);
   READ(infile, N);
-  std::strftime(timeout, 200, "%Y-%m-%d %H:%M:%S (%Z)", std::gmtime(reinterpret_cast<time_t*>(&N)));
+  const time_t timestamp = N;
+  std::strftime(timeout, 200, "%Y-%m-%d %H:%M:%S (%Z)", std::gmtime(&timestamp));
   std::cout << "Timestamp: " << timeout << std::endl << std::endl << "Header:" << std::endl;
 
   infile.seekg(0x4A, std::fstream::beg);
@@ -198,30 +198,25 @@ int main(int argc, char * argv[])
   if (!parse) return 0;
 
   std::cout << std::endl << "Main Data:" << std::dec << std::endl << std::endl;
-  infile.seekg(0xFA8, std::fstream::beg);
 
-  for (size_t counter = 0; !infile.eof(); ++counter)
-  {
-    READ(infile, N);
-    READ(infile, L);
-    READ(infile, S);
-
-    if (S > 10000) { throw std::length_error("Requested chunk length too big."); }
+  std::vector<uint32_t> ends;
+  replay_chunk_t chunk;
+  ChunkStatus status;
 
-    if (N == 0xFFFFFFFF && L == 0xFFFF) { std::cout << "Replay duration: " << timecode_to_string(Nlast) << std::endl; break; }
+  for (size_t counter = 0; (status = replay->next(chunk)) == CHUNK_OK; ++counter)
+  {
+    const uint32_t N = chunk.timecode, L = chunk.type, S = chunk.length;
 
     Nlast = N;
 
-    if (S > 200) { std::cout << "At position " << infile.tellg() << " we read N = " << N << ", type = " << L << ", size = " << S << std::endl; return 1; }
+    if (S > 200) { std::cout << "At position " << chunk.offset + 8 << " we read N = " << N << ", type = " << L << ", size = " << S << std::endl; return 1; }
 
-    std::vector<char> vbuf(S);
-    infile.read(vbuf.data(), S);
-    const unsigned char * const buf = reinterpret_cast<const unsigned char*>(vbuf.data());
+    const unsigned char * const buf = chunk.data;
 
     if (parse == 1)
     {
       std::cout << "Chunk " << counter << " (size " << S << "), timecode " << timecode_to_string(N)
-                << " (" << N << "), type = " << L << ". Now at " << infile.tellg() << "." << std::endl;
+                << " (" << N << "), type = " << L << ". Now at " << replay->position() << "." << std::endl;
       hexdump(stdout, buf, S, "  --> ");
       std::cout << std::endl;
     }
@@ -229,12 +224,17 @@ int main(int argc, char * argv[])
     {
       if (L == 1)
       {
-        std::cout << "Chunk type 1 (size " << S << "), timecode " << timecode_to_string(N) << ", number " << *reinterpret_cast<const uint16_t *>(buf)
-                  << ", number of commands = " << *reinterpret_cast<const uint32_t *>(buf+2) << ". Dissecting commands:" << std::endl;
+        std::cout << "Chunk type 1 (size " << S << "), timecode " << timecode_to_string(N) << ", number " << READ_UINT16LE(buf[0], buf[1])
+                  << ", number of commands = " << READ_UINT32LE(buf + 2) << ". Dissecting commands:" << std::endl;
+        /* All "0, 0, 0xFF" in the chunk; each command ends at the next one, or at the end of the chunk. */
+        find_terminators(buf, S, 2, ends);
+        std::vector<uint32_t>::const_iterator e = ends.begin();
+
         size_t p = 6, q = p;
         while (p < S)
         {
-          while (!(buf[p] == 0 && buf[p+1] == 0 && buf[p+2] == 0xFF) && p < S) p++;
+          while (e != ends.end() && *e < p + 2) ++e;
+          p = e != ends.end() ? *e - 2 : S;
           hexdump(stdout, buf + q, p-q, " -----> ");
           p += 3;
           q = p;
@@ -243,10 +243,10 @@ int main(int argc, char * argv[])
       }
       else if (L == 2)
       {
-        if (buf[1] == 1 && buf[2] == 0 && buf[7] == 5 && *reinterpret_cast<const uint32_t*>(buf+8) == N)
+        if (buf[1] == 1 && buf[2] == 0 && buf[7] == 5 && READ_UINT32LE(buf + 8) == N)
         {
           std::cout << "Chunk type 2 (size " << S << "), timecode " << timecode_to_string(N) << ", number "
-                    << (unsigned int)(buf[0]) << ", player " << *reinterpret_cast<const uint32_t *>(buf+3) << ". Payload:" << std::endl;
+                    << (unsigned int)(buf[0]) << ", player " << READ_UINT32LE(buf + 3) << ". Payload:" << std::endl;
           hexdump(stdout, buf + 12, S - 12, " -2-> ");
           std::cout << std::endl;
         }
@@ -266,11 +266,16 @@ int main(int argc, char * argv[])
     }
   }
 
-  std::cout << "End of file reached normally. Footer is " << S << " bytes:" << std::endl;
+  if (status != CHUNK_END)
+  {
+    std::cout << "The replay breaks off at offset " << chunk.offset << "." << std::endl;
+    return 1;
+  }
+
+  std::cout << "Replay duration: " << timecode_to_string(Nlast) << std::endl;
+  std::cout << "End of file reached normally. Footer is " << chunk.length << " bytes:" << std::endl;
 
-  std::vector<char> footer(S);
-  infile.read(footer.data(), S);
-  hexdump(stdout, reinterpret_cast<unsigned char*>(footer.data()), S, "  ==> ");
+  hexdump(stdout, chunk.data, chunk.length, "  ==> ");
 
   std::cout << std::endl;
 }
@@ -2,7 +2,7 @@
 
 
 const char * WEEKDAYS[] = { "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday", "[ERROR]" };
-char WEEKDAY_ERROR[8];
+thread_local char WEEKDAY_ERROR[8];
 
 const char * weekday(unsigned int d)
 {
@@ -11,6 +11,18 @@ const char * weekday(unsigned int d)
 }
 
 
+size_t strftime_utc(char * s, size_t max, const char * format, time_t t)
+{
+  std::tm tm;
+#ifdef _WIN32
+  gmtime_s(&tm, &t);
+#else
+  gmtime_r(&t, &tm);
+#endif
+  return std::strftime(s, max, format, &tm);
+}
+
+
 void codepointToUTF8(unsigned int cp, codepoint_t * szOut)
 {
   size_t len = 0;
@@ -56,63 +68,227 @@ std::string read1ByteString(std::istream & in)
   return s;
 }
 
-std::string read2ByteString(std::istream & in)
+size_t utf16le_strnlen(const unsigned char * in, size_t n)
 {
-  codepoint_t     ccp;
-  twobytestring_t cbuf;
-  std::string     s;
+  size_t i = 0;
 
-  while (true)
+#if defined(__AVX2__)
+  for ( ; i + 16 <= n; i += 16)
+  {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i));
+    const unsigned int zero = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_setzero_si256()));
+    if (zero) return i + __builtin_ctz(zero) / 2;
+  }
+#endif
+#if defined(__SSE2__)
+  for ( ; i + 8 <= n; i += 8)
   {
-    in.read(reinterpret_cast<char*>(&cbuf), sizeof(twobytestring_t));
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+    const unsigned int zero = _mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128()));
+    if (zero) return i + __builtin_ctz(zero) / 2;
+  }
+#endif
 
-    if (READ_UINT16LE(cbuf.byte1, cbuf.byte2) == 0)
-      break;
+  for ( ; i < n; ++i)
+    if (in[2 * i] == 0 && in[2 * i + 1] == 0) return i;
+
+  return n;
+}
+
+/* Each block gives a bit mask of the 0xFF bytes, which is narrowed down by the masks of
+ * the zero bytes just before them; the remaining bits are the hits, lowest first.
+ */
+void find_terminators(const unsigned char * buf, size_t len, unsigned int zeros, std::vector<uint32_t> & hits)
+{
+  hits.clear();
+
+  size_t i = zeros;   // the first few bytes lack the predecessors
 
-    codepointToUTF8(READ_UINT16LE(cbuf.byte1, cbuf.byte2), &ccp);
+#if defined(__AVX2__)
+  for ( ; i + 32 <= len; i += 32)
+  {
+    const __m256i ff = _mm256_set1_epi8(char(0xFF));
+    unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i)), ff));
+
+    for (unsigned int k = 1; k <= zeros && m != 0; ++k)
+      m &= _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i - k)),
+                                                   _mm256_setzero_si256()));
 
-    s += std::string(ccp.c);
+    for ( ; m != 0; m &= m - 1) hits.push_back(uint32_t(i + __builtin_ctz(m)));
   }
+#endif
+#if defined(__SSE2__)
+  for ( ; i + 16 <= len; i += 16)
+  {
+    const __m128i ff = _mm_set1_epi8(char(0xFF));
+    unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i)), ff));
 
-  return s;
+    for (unsigned int k = 1; k <= zeros && m != 0; ++k)
+      m &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i - k)),
+                                             _mm_setzero_si128()));
+
+    for ( ; m != 0; m &= m - 1) hits.push_back(uint32_t(i + __builtin_ctz(m)));
+  }
+#endif
+
+  for ( ; i < len; ++i)
+  {
+    if (buf[i] != 0xFF) continue;
+
+    unsigned int k = 1;
+    while (k <= zeros && buf[i - k] == 0) ++k;
+    if (k > zeros) hits.push_back(uint32_t(i));
+  }
 }
 
-std::string read2ByteStringN(std::istream & in, size_t N)
+/* Runs of printable ASCII (8 or 16 units at a time) are narrowed with a single pack;
+ * everything else goes through the scalar encoder one code point at a time.
+ */
+void utf16le_to_utf8(const unsigned char * in, size_t n, std::string & out)
 {
-  codepoint_t     ccp;
-  twobytestring_t cbuf;
-  std::string     s;
-  size_t          n = N;
+  const size_t start = out.size();
+  out.resize(start + 3 * n);
+
+  unsigned char * const base = reinterpret_cast<unsigned char *>(&out[0]);
+  unsigned char * o = base + start;
+  size_t i = 0;
 
-  while (n--)
+  while (i < n)
   {
-    in.read(reinterpret_cast<char*>(&cbuf), sizeof(twobytestring_t));
-    codepointToUTF8(READ_UINT16LE(cbuf.byte1, cbuf.byte2), &ccp);
-    s += std::string(ccp.c);
+#if defined(__AVX2__)
+    if (i + 16 <= n)
+    {
+      const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i));
+      const __m256i high = _mm256_and_si256(v, _mm256_set1_epi16(int16_t(0xFF80)));
+      const __m256i zero = _mm256_cmpeq_epi16(v, _mm256_setzero_si256());
+      if (_mm256_testz_si256(high, high) && _mm256_testz_si256(zero, zero))
+      {
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0xD8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm256_castsi256_si128(packed));
+        o += 16; i += 16;
+        continue;
+      }
+    }
+#endif
+#if defined(__SSE2__)
+    if (i + 8 <= n)
+    {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+      const __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(int16_t(0xFF80))), _mm_setzero_si128());
+      const __m128i zero = _mm_cmpeq_epi16(v, _mm_setzero_si128());
+      if (_mm_movemask_epi8(ascii) == 0xFFFF && _mm_movemask_epi8(zero) == 0)
+      {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(o), _mm_packus_epi16(v, v));
+        o += 8; i += 8;
+        continue;
+      }
+    }
+#endif
+
+    /* Scalar: at most one vector's worth of units, then try the fast path again. */
+    for (const size_t end = std::min(n, i + 8); i < end; ++i)
+    {
+      unsigned int cp = READ_UINT16LE(in[2 * i], in[2 * i + 1]);
+
+      if (cp == 0) continue;
+
+      if (cp >= 0xD800 && cp < 0xE000)
+      {
+        const unsigned int lo = i + 1 < n ? READ_UINT16LE(in[2 * i + 2], in[2 * i + 3]) : 0;
+
+        if (cp < 0xDC00 && lo >= 0xDC00 && lo < 0xE000)
+        {
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+          ++i;
+        }
+        else
+        {
+          cp = 0xFFFD;
+        }
+      }
+
+      if (cp < 0x80)
+      {
+        *o++ = cp;
+      }
+      else if (cp < 0x800)
+      {
+        *o++ = 0xC0 | (cp >> 6);
+        *o++ = 0x80 | (cp & 0x3F);
+      }
+      else if (cp < 0x10000)
+      {
+        *o++ = 0xE0 | (cp >> 12);
+        *o++ = 0x80 | ((cp >> 6) & 0x3F);
+        *o++ = 0x80 | (cp & 0x3F);
+      }
+      else
+      {
+        *o++ = 0xF0 | (cp >> 18);
+        *o++ = 0x80 | ((cp >> 12) & 0x3F);
+        *o++ = 0x80 | ((cp >> 6) & 0x3F);
+        *o++ = 0x80 | (cp & 0x3F);
+      }
+    }
   }
 
-  return s;
+  out.resize(o - base);
 }
 
-std::string read2ByteString(const char * in, size_t N)
+/* The stream versions collect the code units straight from the stream buffer
+ * and transcode them in one go.
+ */
+std::string read2ByteString(std::istream & in)
 {
-  codepoint_t     ccp;
-  twobytestring_t cbuf;
-  std::string     s;
+  std::streambuf * const sb = in.rdbuf();
+  unsigned char units[512];
+  size_t n = 0;
+  std::string s;
 
-  while (N > 1)
+  while (in)
   {
-    cbuf.byte1 = *in++; --N;
-    cbuf.byte2 = *in++; --N;
-
-    if (READ_UINT16LE(cbuf.byte1, cbuf.byte2) == 0)
+    if (sb->sgetn(reinterpret_cast<char*>(units + 2 * n), 2) != 2)
+    {
+      in.setstate(std::ios::eofbit | std::ios::failbit);
       break;
+    }
 
-    codepointToUTF8(READ_UINT16LE(cbuf.byte1, cbuf.byte2), &ccp);
+    if (units[2 * n] == 0 && units[2 * n + 1] == 0)
+      break;
 
-    s += std::string(ccp.c);
+    if (++n == sizeof(units) / 2)
+    {
+      /* Keep a high surrogate back for its partner. */
+      const bool high = units[2 * n - 1] >= 0xD8 && units[2 * n - 1] < 0xDC;
+      utf16le_to_utf8(units, n - high, s);
+      if (high) { units[0] = units[2 * n - 2]; units[1] = units[2 * n - 1]; }
+      n = high;
+    }
   }
 
+  utf16le_to_utf8(units, n, s);
+
+  return s;
+}
+
+std::string read2ByteStringN(std::istream & in, size_t N)
+{
+  std::vector<unsigned char> units(2 * N);
+  std::string s;
+
+  in.read(reinterpret_cast<char*>(units.data()), units.size());
+  utf16le_to_utf8(units.data(), size_t(in.gcount()) / 2, s);
+
+  return s;
+}
+
+std::string read2ByteString(const char * in, size_t N)
+{
+  const unsigned char * const u = reinterpret_cast<const unsigned char *>(in);
+  std::string s;
+
+  utf16le_to_utf8(u, utf16le_strnlen(u, N / 2), s);
+
   return s;
 }
 
@@ -140,31 +316,201 @@ std::vector<std::string> tokenize(const std::string & str, const std::string & d
 }
 
 
+/* Lookup tables for hexdump(): "0x" + two hex digits + ' ' for each byte value,
+ * and the character printed in the ASCII column.
+ */
+struct hexdump_tables_t
+{
+  char hex[256][5];
+  char ascii[256];
+
+  hexdump_tables_t()
+  {
+    static const char digits[] = "0123456789ABCDEF";
+    for (unsigned int c = 0; c < 256; ++c)
+    {
+      hex[c][0] = '0'; hex[c][1] = 'x'; hex[c][2] = digits[c >> 4]; hex[c][3] = digits[c & 0x0F]; hex[c][4] = ' ';
+      ascii[c] = (c < 32 || c > 126) ? '.' : char(c);
+    }
+  }
+};
+
+static const hexdump_tables_t HEXDUMP_TABLES;
+
 void asciiprint(FILE * out, unsigned char c)
 {
-  if (c < 32 || c > 126) fprintf(out, ".");
-  else fprintf(out, "%c", c);
+  fputc(HEXDUMP_TABLES.ascii[c], out);
 }
 
-
+/* The rows are formatted into a local buffer, which goes out in one fwrite() whenever
+ * it is full; the output is the same as printing every byte on its own.
+ */
 void hexdump(FILE * out, const unsigned char * buf, size_t length, const char * delim)
 {
-  for (size_t k = 0; 16*k < length; k++)
+  const size_t ROW = 16 * 5 + 4 + 16 + 1;
+  const size_t dlen = strlen(delim);
+  char line[8192];
+  size_t n = 0;
+
+  for (size_t k = 0; k < length; k += 16)
+  {
+    const size_t m = std::min<size_t>(16, length - k);
+
+    if (n + dlen + ROW > sizeof(line)) { fwrite(line, 1, n, out); n = 0; }
+
+    if (dlen + ROW > sizeof(line)) fwrite(delim, 1, dlen, out);
+    else { memcpy(line + n, delim, dlen); n += dlen; }
+
+    for (size_t i = 0; i < m; ++i, n += 5) memcpy(line + n, HEXDUMP_TABLES.hex[buf[k + i]], 5);
+
+    memset(line + n, ' ', 5 * (16 - m) + 4);
+    n += 5 * (16 - m) + 4;
+
+    for (size_t i = 0; i < m; ++i) line[n++] = HEXDUMP_TABLES.ascii[buf[k + i]];
+
+    line[n++] = '\n';
+  }
+
+  fwrite(line, 1, n, out);
+}
+
+
+bool RecordBuffer::put_fixed2(double x)
+{
+  if (!(x > -1e15 && x < 1e15)) return false;
+
+  const long long v = llround(x * 100.0);
+  const unsigned long long a = v < 0 ? 0ULL - (unsigned long long)(v) : (unsigned long long)(v);
+
+  if (v < 0) put('-');
+  put_uint(a / 100);
+  put('.');
+  put(char('0' + a / 10 % 10));
+  put(char('0' + a % 10));
+  return true;
+}
+
+void RecordBuffer::put_json_string(const char * s)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  put('"');
+  for ( ; *s; ++s)
+  {
+    const unsigned char c = *s;
+    if (c == '"' || c == '\\') { put('\\'); put(char(c)); }
+    else if (c < 0x20)         { put("\\u00", 4); put(hex[c >> 4]); put(hex[c & 15]); }
+    else                       put(char(c));
+  }
+  put('"');
+}
+
+void RecordBuffer::put_csv_field(const char * s)
+{
+  if (strpbrk(s, ",\"\r\n") == NULL) { put(s); return; }
+
+  put('"');
+  for ( ; *s; ++s)
+  {
+    if (*s == '"') put('"');
+    put(*s);
+  }
+  put('"');
+}
+
+
+void ApmTimeline::build(const ApmHistogram & histo, Options::GameType gametype, unsigned int final_timecode)
+{
+  frames = final_timecode;
+  with_clicks.clear();
+  without_clicks.clear();
+
+  for (unsigned int p = 0; p < 256; ++p)
+  {
+    if (!histo.player(p)) continue;
+    for (unsigned int c = 0; c < 256; ++c)
+      if (apm_counted(c, gametype) && !histo.player(p)->commands[c].empty())
+        frames = std::max(frames, histo.player(p)->commands[c].back() + 1);
+  }
+
+  /* Count the actions per frame first, then sum them up in place. */
+  for (unsigned int p = 0; p < 256; ++p)
+  {
+    if (!histo.player(p)) continue;
+
+    const unsigned int player = mangle_player(p, gametype);
+
+    for (unsigned int c = 0; c < 256; ++c)
+    {
+      const ApmHistogram::timecodes_t & tc = histo.player(p)->commands[c];
+      if (tc.empty() || !apm_counted(c, gametype)) continue;
+
+      sums_t & all = with_clicks[player];
+      sums_t & noclicks = without_clicks[player];
+      if (all.empty()) { all.assign(frames + 1, 0); noclicks.assign(frames + 1, 0); }
+
+      const bool click = c == 0xF8 || c == 0xF5;
+      for (size_t k = 0; k != tc.size(); ++k)
+      {
+        all[tc[k] + 1]++;
+        if (!click) noclicks[tc[k] + 1]++;
+      }
+    }
+  }
+
+  for (std::map<unsigned int, sums_t>::iterator it = with_clicks.begin(); it != with_clicks.end(); ++it)
   {
-    fprintf(out, "%s", delim);
+    std::partial_sum(it->second.begin(), it->second.end(), it->second.begin());
+    sums_t & noclicks = without_clicks[it->first];
+    std::partial_sum(noclicks.begin(), noclicks.end(), noclicks.begin());
+  }
+}
 
-    for (int i = 0; i < 16 && 16*k + i < length; ++i)
-      fprintf(out, "0x%02X ", buf[16*k + i]);
+std::vector<unsigned int> ApmTimeline::players() const
+{
+  std::vector<unsigned int> result;
+  for (std::map<unsigned int, sums_t>::const_iterator it = with_clicks.begin(); it != with_clicks.end(); ++it)
+    result.push_back(it->first);
+  return result;
+}
 
-    if (16*(k+1) > length) for (size_t i = 0; i < 16*(k+1)-length; ++i) fprintf(out, "     ");
+const ApmTimeline::sums_t * ApmTimeline::sums(unsigned int p, bool clicks) const
+{
+  const std::map<unsigned int, sums_t> & m = clicks ? with_clicks : without_clicks;
+  std::map<unsigned int, sums_t>::const_iterator it = m.find(p);
+  return it == m.end() ? NULL : &it->second;
+}
 
-    fprintf(out, "    ");
+unsigned int ApmTimeline::actions(unsigned int p, unsigned int from, unsigned int to, bool clicks) const
+{
+  const sums_t * const s = sums(p, clicks);
+  to = std::min(to, frames);
+  if (s == NULL || from >= to) return 0;
+  return (*s)[to] - (*s)[from];
+}
 
-    for (size_t i = 0; i < 16 && 16*k + i < length; ++i)
-      asciiprint(out, buf[16*k + i]);
+double ApmTimeline::apm(unsigned int p, unsigned int from, unsigned int to, bool clicks) const
+{
+  to = std::min(to, frames);
+  if (from >= to) return 0.0;
+  return actions(p, from, to, clicks) * 900.0 / (to - from);
+}
 
-    fprintf(out, "\n");
+double ApmTimeline::peak_apm(unsigned int p, unsigned int window, unsigned int & start, bool clicks) const
+{
+  const sums_t * const s = sums(p, clicks);
+  start = 0;
+  window = std::min(window, frames);
+  if (s == NULL || window == 0) return 0.0;
+
+  unsigned int best = 0;
+  for (unsigned int t = 0; t + window <= frames; ++t)
+  {
+    const unsigned int n = (*s)[t + window] - (*s)[t];
+    if (n > best) { best = n; start = t; }
   }
+
+  return best * 900.0 / window;
 }
 
 
@@ -176,6 +522,28 @@ std::string timecode_to_string(unsigned int tc)
 }
 
 
+bool parse_timecode_arg(const char * str, uint32_t & tc)
+{
+  char * e;
+  const unsigned long a = std::strtoul(str, &e, 10);
+
+  if (e == str) return false;
+
+  if (*e == ':')
+  {
+    const char * s = e + 1;
+    const unsigned long b = std::strtoul(s, &e, 10);
+    if (e == s || *e != '\0' || b >= 60) return false;
+    tc = uint32_t((a * 60 + b) * 15);
+    return true;
+  }
+
+  if (*e != '\0') return false;
+  tc = uint32_t(a);
+  return true;
+}
+
+
 std::set<int> parse_int_sequence_arg(char * str)
 {
   char * s = str;
@@ -196,3 +564,1085 @@ std::set<int> parse_int_sequence_arg(char * str)
 
   return result;
 }
+
+
+bool MappedFile::open(const char * filename)
+{
+  close();
+
+#ifndef _WIN32
+  const int fd = ::open(filename, O_RDONLY);
+  if (fd == -1) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+
+  size_ = st.st_size;
+
+  if (size_ != 0)
+  {
+    /* Reserve room for the padding in anonymous (zero) pages, and map the file over the
+     * front of it. The rest of the file's last page reads as zeros, too.
+     */
+    const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    mapped_ = (size_ + CHUNK_PADDING + page - 1) / page * page;
+
+    void * p = mmap(NULL, mapped_, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { ::close(fd); size_ = mapped_ = 0; return false; }
+
+    if (mmap(p, size_, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+      munmap(p, mapped_);
+      ::close(fd);
+      size_ = mapped_ = 0;
+      return false;
+    }
+
+    madvise(p, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const unsigned char *>(p);
+  }
+
+  ::close(fd);
+  return true;
+#else
+  std::ifstream in(filename, std::ios::in | std::ios::binary);
+  if (!in) return false;
+
+  in.seekg(0, std::fstream::end);
+  size_ = size_t(in.tellg());
+  buffer_.assign(size_ + CHUNK_PADDING, 0);
+  in.seekg(0, std::fstream::beg);
+  in.read(reinterpret_cast<char*>(buffer_.data()), size_);
+
+  data_ = buffer_.data();
+  return true;
+#endif
+}
+
+void MappedFile::close()
+{
+#ifndef _WIN32
+  if (data_ != NULL) munmap(const_cast<unsigned char *>(data_), mapped_);
+#else
+  std::vector<unsigned char>().swap(buffer_);
+#endif
+  data_ = NULL;
+  size_ = mapped_ = 0;
+}
+
+
+ChunkStatus ChunkReader::next(chunk_view_t & chunk)
+{
+  const size_t avail = end - begin;
+
+  chunk.offset = pos;
+  chunk.length = 0;
+  chunk.data   = NULL;
+
+  if (pos + 4 > avail) return CHUNK_TRUNCATED;
+
+  chunk.timecode = READ_UINT32LE(begin + pos);
+
+  if (chunk.timecode == 0x7FFFFFFF) { pos += 4; return CHUNK_END; }
+
+  if (pos + 9 > avail) return CHUNK_TRUNCATED;
+
+  chunk.type   = char(begin[pos + 4]);
+  chunk.length = READ_UINT32LE(begin + pos + 5);
+
+  if (avail - (pos + 9) < size_t(chunk.length) + 4) return CHUNK_TRUNCATED;
+
+  chunk.data = begin + pos + 9;
+  pos += 9 + size_t(chunk.length) + 4;
+
+  return CHUNK_OK;
+}
+
+
+/* A chunk frame that could be real: a known type, a time code of less than
+ * a day, a length the dissector accepts, and the closing zero word in place.
+ */
+static bool plausible_chunk(const unsigned char * data, size_t size, size_t pos)
+{
+  if (pos + 13 > size) return false;
+
+  const uint32_t timecode = READ_UINT32LE(data + pos), length = READ_UINT32LE(data + pos + 5);
+  const char type = char(data[pos + 4]);
+
+  return timecode < 15 * 3600 * 24 && ((type >= 1 && type <= 4) || type == -2) &&
+         length <= 10000 && size - (pos + 13) >= length && READ_UINT32LE(data + pos + 9 + length) == 0;
+}
+
+ChunkStatus find_last_chunk(const MappedFile & file, size_t firstchunk, size_t & lastgood)
+{
+  /* The last, partial 4 KiB block and four full ones before it: enough for two of the longest chunks. */
+  const size_t BLOCK = 4096, TAIL = (file.size() % BLOCK) + 4 * BLOCK;
+  const unsigned char * data = file.data();
+  const size_t size = file.size();
+
+  size_t start = firstchunk;
+
+  if (size > firstchunk + TAIL)
+  {
+    for (size_t pos = size - 13; pos >= size - TAIL; --pos)
+    {
+      if (!plausible_chunk(data, size, pos)) continue;
+
+      /* Confirmed by the frame that ends right before it. */
+      for (size_t prev = pos - 13; prev + 10013 >= pos && prev >= size - TAIL; --prev)
+      {
+        if (plausible_chunk(data, size, prev) && prev + 13 + READ_UINT32LE(data + prev + 5) == pos &&
+            READ_UINT32LE(data + prev) <= READ_UINT32LE(data + pos))
+        {
+          start = prev;
+          break;
+        }
+      }
+
+      if (start != firstchunk) break;
+    }
+  }
+
+  ChunkReader chunks(file, start);
+  chunk_view_t chunk;
+  ChunkStatus status;
+
+  lastgood = 0;
+  while ((status = chunks.next(chunk)) == CHUNK_OK) lastgood = chunk.offset;
+
+  return status;
+}
+
+/* The replay's size and modification time, which the chunk index is keyed on. */
+static bool replay_identity(const char * replay, uint64_t & size, int64_t & mtime)
+{
+  struct stat st;
+  if (stat(replay, &st) != 0) return false;
+  size  = uint64_t(st.st_size);
+  mtime = int64_t(st.st_mtime);
+  return true;
+}
+
+bool ChunkIndex::load(const char * replay, uint32_t firstchunk)
+{
+  uint64_t size;
+  int64_t mtime;
+  chunk_index_header_t h;
+
+  if (!replay_identity(replay, size, mtime) || !sidecar.open(sidecar_name(replay).c_str())) return false;
+
+  if (sidecar.size() < sizeof(h)) { sidecar.close(); return false; }
+  memcpy(&h, sidecar.data(), sizeof(h));
+
+  if (memcmp(h.magic, "CNC3IDX\0", 8) || h.version != 1 || h.replay_size != size || h.replay_mtime != mtime ||
+      h.firstchunk != firstchunk || sidecar.size() != sizeof(h) + size_t(h.count) * sizeof(chunk_index_entry_t))
+  {
+    sidecar.close();
+    return false;
+  }
+
+  entries = reinterpret_cast<const chunk_index_entry_t *>(sidecar.data() + sizeof(h));
+  count   = h.count;
+  end_    = h.end;
+  return true;
+}
+
+void ChunkIndex::build(const MappedFile & file, uint32_t firstchunk)
+{
+  ChunkReader chunks(file, firstchunk);
+  chunk_view_t chunk;
+  built.clear();
+
+  while (chunks.next(chunk) == CHUNK_OK)
+  {
+    chunk_index_entry_t e = { chunk.timecode, uint32_t(chunk.offset), chunk.length, uint8_t(chunk.type), { 0, 0, 0 } };
+    built.push_back(e);
+  }
+
+  entries = built.data();
+  count   = built.size();
+  end_    = chunk.offset;
+}
+
+bool ChunkIndex::save(const char * replay, uint32_t firstchunk) const
+{
+  chunk_index_header_t h;
+  memcpy(h.magic, "CNC3IDX\0", 8);
+  h.version    = 1;
+  h.count      = uint32_t(count);
+  h.firstchunk = firstchunk;
+  h.end        = uint32_t(end_);
+
+  if (!replay_identity(replay, h.replay_size, h.replay_mtime)) return false;
+
+  FILE * f = fopen(sidecar_name(replay).c_str(), "wb");
+  if (f == NULL) return false;
+
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(entries, sizeof(chunk_index_entry_t), count, f) == count;
+  ok = (fclose(f) == 0) && ok;
+
+  if (!ok) remove(sidecar_name(replay).c_str());
+  return ok;
+}
+
+size_t ChunkIndex::lower_bound(uint32_t timecode) const
+{
+  size_t lo = 0, hi = count;
+
+  while (lo < hi)
+  {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (entries[mid].timecode < timecode) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+
+bool file_identity(const char * filename, file_identity_t & id)
+{
+  struct stat st;
+  std::vector<unsigned char> head, tail;
+  uint64_t size;
+
+  if (stat(filename, &st) != 0 || !read_head_and_tail(filename, 4096, 0, head, tail, size)) return false;
+
+  id.dev   = uint64_t(st.st_dev);
+  id.ino   = uint64_t(st.st_ino);
+  id.size  = uint64_t(st.st_size);
+  id.mtime = int64_t(st.st_mtime);
+
+  /* FNV-1a */
+  id.head_hash = 14695981039346656037ULL;
+  for (size_t i = 0; i != head.size(); ++i) id.head_hash = (id.head_hash ^ head[i]) * 1099511628211ULL;
+
+  return true;
+}
+
+static bool same_identity(const file_identity_t & a, const file_identity_t & b)
+{
+  return a.dev == b.dev && a.ino == b.ino && a.size == b.size && a.mtime == b.mtime && a.head_hash == b.head_hash;
+}
+
+/* The cache file: "CNC3CCH\0", uint32 version, then the entries, each
+ * { file_identity_t; uint8 res; uint32 lengths of file, mode, out, err; the four strings }.
+ * The version changes whenever the output of a cached mode changes.
+ */
+static const uint32_t RESULT_CACHE_VERSION = 1;
+
+void ResultCache::load(const char * filename)
+{
+  std::lock_guard<std::mutex> lock(mx);
+  entries.clear();
+
+  std::ifstream f(filename, std::ios::in | std::ios::binary);
+  if (!f) return;
+
+  const std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  const char * p = data.data(), * end = p + data.size();
+  uint32_t version;
+
+  if (data.size() < 12 || memcmp(p, "CNC3CCH\0", 8)) return;
+  memcpy(&version, p + 8, 4);
+  if (version != RESULT_CACHE_VERSION) return;
+  p += 12;
+
+  while (size_t(end - p) >= sizeof(file_identity_t) + 1 + 16)
+  {
+    entry_t e;
+    uint32_t len[4];
+
+    memcpy(&e.id, p, sizeof(file_identity_t));
+    e.res = p[sizeof(file_identity_t)] != 0;
+    memcpy(len, p + sizeof(file_identity_t) + 1, 16);
+    p += sizeof(file_identity_t) + 1 + 16;
+
+    if (uint64_t(len[0]) + len[1] + len[2] + len[3] > uint64_t(end - p)) break;
+
+    std::string file(p, len[0]), mode(p + len[0], len[1]);
+    p += len[0] + len[1];
+    e.out.assign(p, len[2]);
+    p += len[2];
+    e.err.assign(p, len[3]);
+    p += len[3];
+
+    entries[std::make_pair(file, mode)] = e;
+  }
+}
+
+bool ResultCache::save(const char * filename) const
+{
+  std::lock_guard<std::mutex> lock(mx);
+
+  /* Written next to the cache and renamed over it, so that an interrupted run leaves the old cache intact. */
+  const std::string tmp = std::string(filename) + ".tmp";
+  FILE * f = fopen(tmp.c_str(), "wb");
+  if (f == NULL) return false;
+
+  bool ok = fwrite("CNC3CCH\0", 8, 1, f) == 1 && fwrite(&RESULT_CACHE_VERSION, 4, 1, f) == 1;
+
+  for (std::map<std::pair<std::string, std::string>, entry_t>::const_iterator it = entries.begin(); ok && it != entries.end(); ++it)
+  {
+    const entry_t & e = it->second;
+    const uint8_t res = e.res;
+    const uint32_t len[4] = { uint32_t(it->first.first.size()), uint32_t(it->first.second.size()), uint32_t(e.out.size()), uint32_t(e.err.size()) };
+
+    ok = fwrite(&e.id, sizeof(e.id), 1, f) == 1 && fwrite(&res, 1, 1, f) == 1 && fwrite(len, 4, 4, f) == 4 &&
+         fwrite(it->first.first.data(), 1, len[0], f) == len[0] && fwrite(it->first.second.data(), 1, len[1], f) == len[1] &&
+         fwrite(e.out.data(), 1, len[2], f) == len[2] && fwrite(e.err.data(), 1, len[3], f) == len[3];
+  }
+
+  ok = (fclose(f) == 0) && ok;
+
+#ifdef _WIN32
+  if (ok) remove(filename);
+#endif
+  if (!ok || rename(tmp.c_str(), filename) != 0) { remove(tmp.c_str()); return false; }
+  return true;
+}
+
+bool ResultCache::lookup(const std::string & file, const std::string & mode, const file_identity_t & id,
+                         std::string & out, std::string & err, bool & res) const
+{
+  std::lock_guard<std::mutex> lock(mx);
+
+  std::map<std::pair<std::string, std::string>, entry_t>::const_iterator it = entries.find(std::make_pair(file, mode));
+  if (it == entries.end() || !same_identity(it->second.id, id)) return false;
+
+  out = it->second.out;
+  err = it->second.err;
+  res = it->second.res;
+  return true;
+}
+
+void ResultCache::store(const std::string & file, const std::string & mode, const file_identity_t & id,
+                        const std::string & out, const std::string & err, bool res)
+{
+  std::lock_guard<std::mutex> lock(mx);
+
+  entry_t & e = entries[std::make_pair(file, mode)];
+  e.id  = id;
+  e.res = res;
+  e.out = out;
+  e.err = err;
+}
+
+
+void ColumnWriter::add_file(const char * name, Options::GameType gametype, uint32_t final_timecode)
+{
+  column_file_entry_t f = { tc_delta.size(), 0, tc_escape.size(), uint32_t(names.size()), final_timecode, uint8_t(gametype),
+                            { 0, 0, 0, 0, 0, 0, 0 } };
+  files.push_back(f);
+  names.append(name).push_back('\0');
+  last_tc = 0;
+}
+
+void ColumnWriter::add_row(uint32_t timecode, uint8_t k, uint8_t p, uint8_t c, const unsigned char * data, size_t length)
+{
+  const uint32_t delta = timecode - last_tc;
+
+  if (timecode < last_tc || delta >= 0xFFFF) { tc_delta.push_back(0xFFFF); tc_escape.push_back(timecode); }
+  else                                       tc_delta.push_back(uint16_t(delta));
+  last_tc = timecode;
+
+  length = std::min<size_t>(length, 0xFFFF);
+
+  kind.push_back(k);
+  player.push_back(p);
+  cmd.push_back(c);
+  payload_offset.push_back(payload.size());
+  payload_length.push_back(uint16_t(length));
+  payload.insert(payload.end(), data, data + length);
+
+  files.back().nrows++;
+}
+
+/* Appends a column to the file, starting on an 8-byte boundary, and notes where it went. */
+static bool write_column(FILE * f, uint64_t & pos, uint64_t & off, const void * data, size_t size)
+{
+  static const char zeros[8] = { 0 };
+  const size_t pad = size_t((8 - pos % 8) % 8);
+
+  if (pad && fwrite(zeros, 1, pad, f) != pad) return false;
+  off  = pos + pad;
+  pos += pad + size;
+  return size == 0 || fwrite(data, 1, size, f) == size;
+}
+
+bool ColumnWriter::write(const char * filename) const
+{
+  column_file_header_t h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "CNC3COL\0", 8);
+  h.version      = 2;
+  h.nfiles       = uint32_t(files.size());
+  h.nrows        = tc_delta.size();
+  h.nescapes     = tc_escape.size();
+  h.payload_size = payload.size();
+  h.names_size   = names.size();
+
+  FILE * f = fopen(filename, "wb");
+  if (f == NULL) return false;
+
+  uint64_t pos = sizeof(h);
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+            write_column(f, pos, h.off_files,          files.data(),          files.size() * sizeof(column_file_entry_t)) &&
+            write_column(f, pos, h.off_tc_delta,       tc_delta.data(),       tc_delta.size() * 2) &&
+            write_column(f, pos, h.off_tc_escape,      tc_escape.data(),      tc_escape.size() * 4) &&
+            write_column(f, pos, h.off_kind,           kind.data(),           kind.size()) &&
+            write_column(f, pos, h.off_player,         player.data(),         player.size()) &&
+            write_column(f, pos, h.off_cmd,            cmd.data(),            cmd.size()) &&
+            write_column(f, pos, h.off_payload_offset, payload_offset.data(), payload_offset.size() * 8) &&
+            write_column(f, pos, h.off_payload_length, payload_length.data(), payload_length.size() * 2) &&
+            write_column(f, pos, h.off_payload,        payload.data(),        payload.size()) &&
+            write_column(f, pos, h.off_names,          names.data(),          names.size());
+
+  /* The offsets are known now; the header goes in last. */
+  ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+  ok = (fclose(f) == 0) && ok;
+
+  if (!ok) remove(filename);
+  return ok;
+}
+
+bool ColumnFile::open(const char * filename)
+{
+  h = NULL;
+  if (!mapped.open(filename) || mapped.size() < sizeof(column_file_header_t)) return false;
+
+  const column_file_header_t * hh = reinterpret_cast<const column_file_header_t *>(mapped.data());
+  const uint64_t size = mapped.size();
+
+  if (memcmp(hh->magic, "CNC3COL\0", 8) || hh->version != 2) return false;
+
+  /* Every row and every escape takes up at least a byte, which keeps the column sizes below from overflowing. */
+  if (hh->nrows > size || hh->nescapes > size) return false;
+
+  const uint64_t offs[]  = { hh->off_files, hh->off_tc_delta, hh->off_tc_escape, hh->off_kind, hh->off_player, hh->off_cmd,
+                             hh->off_payload_offset, hh->off_payload_length, hh->off_payload, hh->off_names };
+  const uint64_t sizes[] = { hh->nfiles * uint64_t(sizeof(column_file_entry_t)), hh->nrows * 2, hh->nescapes * 4, hh->nrows, hh->nrows,
+                             hh->nrows, hh->nrows * 8, hh->nrows * 2, hh->payload_size, hh->names_size };
+
+  for (size_t i = 0; i != sizeof(offs) / sizeof(offs[0]); ++i)
+    if (offs[i] % 8 || offs[i] > size || sizes[i] > size - offs[i]) return false;
+
+  if (hh->names_size != 0 && mapped.data()[hh->off_names + hh->names_size - 1] != '\0') return false;
+
+  h = hh;
+
+  /* The rows hand out pointers into the payload, so each one has to lie within it. */
+  for (size_t r = 0; r != nrows(); ++r)
+  {
+    if (payload_offset()[r] > h->payload_size || payload_length()[r] > h->payload_size - payload_offset()[r])
+    {
+      h = NULL;
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i != nfiles(); ++i)
+  {
+    const column_file_entry_t & f = file(i);
+    if (f.first_row > h->nrows || f.nrows > h->nrows - f.first_row || f.first_escape > h->nescapes || f.name_offset >= h->names_size)
+    {
+      h = NULL;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void ColumnFile::timecodes(size_t i, std::vector<uint32_t> & out) const
+{
+  const column_file_entry_t & f = file(i);
+  const uint16_t * d = tc_delta() + f.first_row;
+  const uint32_t * e = tc_escape() + f.first_escape, * eend = tc_escape() + h->nescapes;
+  uint32_t tc = 0;
+
+  out.resize(f.nrows);
+
+  for (size_t r = 0; r != f.nrows; ++r)
+    out[r] = tc = (d[r] != 0xFFFF ? tc + d[r] : (e != eend ? *e++ : tc));
+}
+
+
+/* write() until all of "buf" is out. */
+#ifndef _WIN32
+static bool write_fully(int fd, const void * buf, size_t n)
+{
+  const char * p = static_cast<const char *>(buf);
+
+  while (n > 0)
+  {
+    const ssize_t k = ::write(fd, p, n);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) return false;
+    p += k;
+    n -= size_t(k);
+  }
+
+  return true;
+}
+#endif
+
+bool copy_file_prefix(const char * from, const char * to, uint64_t n, const void * tail, size_t taillen)
+{
+#ifndef _WIN32
+  const int in = ::open(from, O_RDONLY);
+  if (in < 0) return false;
+
+  const int outfd = ::open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (outfd < 0) { ::close(in); return false; }
+
+  uint64_t done = 0;
+
+#ifdef __linux__
+  while (done < n)
+  {
+    const ssize_t k = copy_file_range(in, NULL, outfd, NULL, size_t(n - done), 0);
+    if (k < 0 && errno == EINTR) continue;
+    if (k <= 0) break;
+    done += uint64_t(k);
+  }
+#endif
+
+  /* Older kernels refuse copy_file_range across file systems; the rest goes through a buffer. */
+  if (done < n)
+  {
+    std::vector<char> buf(1 << 20);
+
+    while (done < n)
+    {
+      const ssize_t k = pread(in, buf.data(), size_t(std::min<uint64_t>(buf.size(), n - done)), off_t(done));
+      if (k < 0 && errno == EINTR) continue;
+      if (k <= 0 || !write_fully(outfd, buf.data(), size_t(k))) break;
+      done += uint64_t(k);
+    }
+  }
+
+  bool ok = done == n && write_fully(outfd, tail, taillen);
+  ok = (::close(outfd) == 0) && ok;
+  ::close(in);
+#else
+  std::ifstream in(from, std::ios::in | std::ios::binary);
+  std::ofstream outf(to, std::ios::out | std::ios::binary);
+  if (!in || !outf) return false;
+
+  std::vector<char> buf(1 << 20);
+  uint64_t done = 0;
+
+  while (done < n && in.read(buf.data(), std::streamsize(std::min<uint64_t>(buf.size(), n - done))))
+  {
+    outf.write(buf.data(), in.gcount());
+    done += uint64_t(in.gcount());
+  }
+
+  outf.write(static_cast<const char *>(tail), taillen);
+  outf.close();
+  const bool ok = done == n && bool(outf);
+#endif
+
+  if (!ok) remove(to);
+  return ok;
+}
+
+bool truncate_and_append(const char * filename, uint64_t n, const void * tail, size_t taillen)
+{
+#ifndef _WIN32
+  const int fd = ::open(filename, O_WRONLY);
+  if (fd < 0) return false;
+
+  bool ok = ftruncate(fd, off_t(n)) == 0 && lseek(fd, off_t(n), SEEK_SET) == off_t(n) && write_fully(fd, tail, taillen);
+  ok = (::close(fd) == 0) && ok;
+  return ok;
+#else
+  (void)filename; (void)n; (void)tail; (void)taillen;
+  return false;
+#endif
+}
+
+
+bool read_head_and_tail(const char * filename, size_t headmax, size_t tailmax,
+                        std::vector<unsigned char> & head, std::vector<unsigned char> & tail, uint64_t & filesize)
+{
+#ifndef _WIN32
+  const int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+  filesize = st.st_size;
+
+  head.resize(std::min<uint64_t>(headmax, filesize));
+  tail.resize(std::min<uint64_t>(tailmax, filesize));
+
+  const bool ok = pread(fd, head.data(), head.size(), 0) == ssize_t(head.size()) &&
+                  pread(fd, tail.data(), tail.size(), filesize - tail.size()) == ssize_t(tail.size());
+  ::close(fd);
+  return ok;
+#else
+  std::ifstream f(filename, std::ios::in | std::ios::binary);
+  if (!f) return false;
+
+  f.seekg(0, std::ios::end);
+  filesize = uint64_t(f.tellg());
+
+  head.resize(std::min<uint64_t>(headmax, filesize));
+  tail.resize(std::min<uint64_t>(tailmax, filesize));
+
+  f.seekg(0, std::ios::beg);
+  f.read(reinterpret_cast<char*>(head.data()), head.size());
+  f.seekg(filesize - tail.size(), std::ios::beg);
+  f.read(reinterpret_cast<char*>(tail.data()), tail.size());
+  return bool(f);
+#endif
+}
+
+const char FOOTERCC[] = "C&C3 REPLAY FOOTER";
+const char FOOTERRA3[] = "RA3 REPLAY FOOTER";
+
+/* A bounds-checked reader over the header bytes; once it runs out of data, "ok"
+ * stays false and all further reads return zero or empty.
+ */
+struct header_cursor_t
+{
+  header_cursor_t(const unsigned char * b, size_t len) : p(b), end(b + len), ok(true) { }
+
+  const unsigned char * skip(size_t n)
+  {
+    if (!ok || size_t(end - p) < n) { ok = false; return NULL; }
+    const unsigned char * q = p;
+    p += n;
+    return q;
+  }
+
+  uint32_t u32()         { const unsigned char * q = skip(4); return q ? READ_UINT32LE(q) : 0; }
+  uint16_t u16()         { const unsigned char * q = skip(2); return q ? READ_UINT16LE(q[0], q[1]) : 0; }
+  unsigned char u8()     { const unsigned char * q = skip(1); return q ? *q : 0; }
+
+  /* A string of single-byte characters, NUL-terminated. */
+  std::string zstring()
+  {
+    const unsigned char * const z = ok ? static_cast<const unsigned char *>(memchr(p, 0, end - p)) : NULL;
+    if (z == NULL) { ok = false; return std::string(); }
+    const std::string s(reinterpret_cast<const char *>(p), z - p);
+    p = z + 1;
+    return s;
+  }
+
+  std::string utf16()
+  {
+    std::string s;
+    const size_t n = ok ? size_t(end - p) / 2 : 0, l = utf16le_strnlen(p, n);
+    if (l == n) { ok = false; return s; }
+    utf16le_to_utf8(p, l, s);
+    p += 2 * l + 2;
+    return s;
+  }
+
+  const unsigned char * p;
+  const unsigned char * end;
+  bool ok;
+};
+
+template <typename T>
+bool parse_fixed_header(header_cursor_t & c, const char * magic, unsigned int maxminor, replay_header_t & h)
+{
+  T header;
+  const unsigned char * const q = c.skip(sizeof(T));
+  if (q == NULL) return false;
+  memcpy(&header, q, sizeof(T));
+
+  if ( strncmp(header.str_magic, magic, sizeof(header.str_magic)) ||
+       ((header.six  != 6 ) && (header.six  != 0x1E )) ||
+       (header.zero != 0 ) ||
+       ((header.number1 != 5) && (header.number1 != 4)) ||
+       ((READ_UINT32LE(header.vermajor) != 1) && (READ_UINT32LE(header.verminor) > maxminor))
+     )
+    return false;
+
+  h.vermajor   = READ_UINT32LE(header.vermajor);
+  h.verminor   = READ_UINT32LE(header.verminor);
+  h.buildmajor = READ_UINT32LE(header.buildmajor);
+  h.buildminor = READ_UINT32LE(header.buildminor);
+  h.number1    = header.number1;
+  h.six        = header.six;
+  return true;
+}
+
+/* The same steps as parse_replay_file(), minus the output. */
+bool parse_replay_header(const unsigned char * buf, size_t len, Options::GameType gametype, replay_header_t & h)
+{
+  header_cursor_t c(buf, len);
+
+  if (gametype == Options::GAME_UNDEF && len >= 17 && !memcmp(buf, "RA3 REPLAY HEADER", 17))
+    gametype = Options::GAME_RA3;
+
+  if (gametype == Options::GAME_RA3 ? !parse_fixed_header<header_ra3_t>(c, "RA3 REPLAY HEADER", 12, h)
+                                    : !parse_fixed_header<header_cnc3_t>(c, "C&C3 REPLAY HEADER", 9, h))
+    return false;
+
+  h.title       = c.utf16();
+  h.description = c.utf16();
+  h.mapname     = c.utf16();
+  h.mapid       = c.utf16();
+
+  const unsigned int nplayers = c.u8();
+
+  h.team_ids.clear();
+  h.team_names.clear();
+
+  for (unsigned int n = 0; n <= nplayers && c.ok; ++n)
+  {
+    h.team_ids.push_back(c.u32());
+    h.team_names.push_back(c.utf16());
+    if (h.number1 == 5) c.u8();
+  }
+
+  const uint32_t offset = c.u32();
+  h.firstchunk = uint32_t(c.p - buf) + 4 + offset;
+
+  if (c.u32() != 8) return false;
+  const unsigned char * const rplmagic = c.skip(8);
+  if (rplmagic == NULL || memcmp(rplmagic, "CNC3RPL\0", 8)) return false;
+
+  /* For TW, version 1.07+, there is this extra bit of info, char modinfo[22]. */
+  if (gametype == Options::GAME_UNDEF)
+  {
+    if (c.ok && size_t(c.end - c.p) >= 22 && !memcmp(c.p, "CNC3", 4))
+    {
+      gametype = Options::GAME_TW;
+      c.skip(22);
+    }
+    else
+    {
+      gametype = Options::GAME_KW;
+    }
+  }
+  else if ((gametype == Options::GAME_TW && h.verminor >= 7) || gametype == Options::GAME_RA3)
+  {
+    c.skip(22);
+  }
+
+  h.gametype  = gametype;
+  h.timestamp = c.u32();
+
+  c.skip(gametype == Options::GAME_RA3 ? 31 : 33);
+
+  const uint32_t hlen = c.u32();
+  if (hlen > 10000) return false;
+
+  const unsigned char * const hs = c.skip(hlen);
+  if (!c.ok) return false;
+
+  h.header_string.assign(hs, hs + hlen);
+  h.players.clear();
+
+  const std::vector<std::string> tokens = tokenize(h.header_string, ";");
+
+  for (size_t t = 0; t < tokens.size(); ++t)
+  {
+    if (tokens[t].size() < 2 || tokens[t][0] != 'S' || tokens[t][1] != '=') continue;
+
+    const std::vector<std::string> subtokens = tokenize(tokens[t].substr(2), ":");
+
+    for (size_t i = 0; i < subtokens.size(); ++i)
+    {
+      const bool computer = subtokens[i].size() > 2 && subtokens[i][0] == 'C' && subtokens[i][2] == ',';
+      if (subtokens[i][0] != 'H' && !computer) continue;
+
+      replay_player_t player;
+      player.computer = computer;
+      player.fields = tokenize(subtokens[i].substr(computer ? 0 : 1), ",");
+
+      if (player.fields.size() < 6) return false;
+
+      player.name    = player.fields[0];
+      player.faction = std::atoi(player.fields[computer ? 2 : 5].c_str());
+      h.players.push_back(player);
+    }
+  }
+
+  return true;
+}
+
+bool parse_replay_footer(const unsigned char * tail, size_t len, Options::GameType gametype, replay_footer_t & f)
+{
+  const size_t mlen = gametype == Options::GAME_RA3 ? 17 : 18;
+
+  if (len < 4) return false;
+
+  const uint32_t footer_length = READ_UINT32LE(tail + len - 4);
+
+  if (footer_length >= 100 || footer_length < mlen + 8 || footer_length > len) return false;
+
+  const unsigned char * const p = tail + len - footer_length;
+
+  if (memcmp(p, gametype == Options::GAME_RA3 ? FOOTERRA3 : FOOTERCC, mlen)) return false;
+
+  f.final_timecode = READ_UINT32LE(p + mlen);
+  f.data.assign(p + mlen + 4, tail + len - 4);
+  f.kill_death.clear();
+
+  if (f.data.size() == 42 || f.data.size() == 38)
+  {
+    for (size_t i = f.data.size() - 24; i + 4 <= f.data.size(); i += 4)
+    {
+      float x;
+      memcpy(&x, f.data.data() + i, 4);
+      f.kill_death.push_back(x);
+    }
+  }
+
+  return true;
+}
+
+
+ReplayFormat sniff_replay(const unsigned char * buf, size_t len)
+{
+  if (len >= 18 && !memcmp(buf, "C&C3 REPLAY HEADER", 18)) return REPLAY_CNC3;
+  if (len >= 17 && !memcmp(buf, "RA3 REPLAY HEADER", 17))  return REPLAY_RA3;
+  if (len >= 15 && READ_UINT32LE(buf) == 7 && !memcmp(buf + 4, "CnC4RPLCnC4", 11)) return REPLAY_CNC4;
+  if (len >= 6  && !memcmp(buf, "GENREP", 6))   return REPLAY_GENERALS;
+  if (len >= 8  && !memcmp(buf, "BFMEREPL", 8)) return REPLAY_BFME;
+  if (len >= 8  && !memcmp(buf, "BFME2RPL", 8)) return REPLAY_BFME2;
+  return REPLAY_UNKNOWN;
+}
+
+const char * replay_format_name(ReplayFormat f)
+{
+  switch (f)
+  {
+  case REPLAY_CNC3:     return "C&C3";
+  case REPLAY_RA3:      return "RA3";
+  case REPLAY_CNC4:     return "CnC4";
+  case REPLAY_GENERALS: return "Generals";
+  case REPLAY_BFME:     return "BFME";
+  case REPLAY_BFME2:    return "BFME2";
+  default:              return "unknown";
+  }
+}
+
+Options::GameType sniff_game(const unsigned char * head, size_t len, Options::GameType hint)
+{
+  replay_header_t h;
+
+  switch (sniff_replay(head, len))
+  {
+  case REPLAY_RA3:
+    return Options::GAME_RA3;
+  case REPLAY_CNC3:
+    if (!parse_replay_header(head, len, Options::GAME_UNDEF, h))
+      return hint == Options::GAME_TW || hint == Options::GAME_KW ? hint : Options::GAME_UNDEF;
+    return h.gametype == Options::GAME_TW || hint == Options::GAME_TW ? Options::GAME_TW : Options::GAME_KW;
+  default:
+    return Options::GAME_UNDEF;
+  }
+}
+
+size_t generals_arg_size(unsigned int type, ReplayFormat f)
+{
+  switch (type)
+  {
+  case 0x0: case 0x1: case 0x3: case 0x4: case 0xA: return 4;
+  case 0x2:                                         return 1;
+  case 0x6: case 0x7:                               return 12;
+  case 0x8:                                         return 16;
+  case 0x9:                                         return f == REPLAY_BFME2 ? 4 : 16;
+  default:                                          return 0;
+  }
+}
+
+bool parse_generals_header(const unsigned char * buf, size_t len, ReplayFormat f, generals_header_t & h)
+{
+  header_cursor_t c(buf, len);
+
+  /* The fixed part: "GENREP" or "BFMEREPL"/"BFME2RPL", then the two time stamps. */
+  const size_t magic = f == REPLAY_GENERALS ? 6 : 8;
+  const unsigned char * const fixed = c.skip(f == REPLAY_GENERALS ? 28 : 37);
+  if (fixed == NULL) return false;
+
+  h.time1 = READ_UINT32LE(fixed + magic);
+  h.time2 = READ_UINT32LE(fixed + magic + 4);
+
+  h.filename = c.utf16();
+  const unsigned char * q = c.skip(sizeof(h.datetime));
+  if (q != NULL) memcpy(&h.datetime, q, sizeof(h.datetime));
+  h.version   = c.utf16();
+  h.builddate = c.utf16();
+  h.verminor  = c.u16();
+  h.vermajor  = c.u16();
+
+  if ((q = c.skip(8)) != NULL) memcpy(h.numbers, q, 8);
+  memset(h.bfmenumbers, 0, sizeof(h.bfmenumbers));
+  if (f != REPLAY_GENERALS && (q = c.skip(5)) != NULL) memcpy(h.bfmenumbers, q, 5);
+
+  h.asciiheader = c.zstring();
+
+  h.x = c.u16();
+  for (size_t i = 0; i != 4; ++i) h.y[i] = c.u32();
+  h.z[0] = h.z[1] = 0;
+  if (f == REPLAY_BFME2) { h.z[0] = c.u32(); h.z[1] = c.u32(); }
+
+  h.firstchunk = uint32_t(c.p - buf);
+  return c.ok;
+}
+
+Options::GameType game_from_filename(const char * filename)
+{
+  std::string fn(filename);
+  std::transform(fn.begin(), fn.end(), fn.begin(), ::tolower);
+
+  if (fn.rfind(".cnc3replay") + 11 == fn.length()) return Options::GAME_TW;
+  if (fn.rfind(".kwreplay") + 9 == fn.length())    return Options::GAME_KW;
+  if (fn.rfind(".ra3replay") + 10 == fn.length())  return Options::GAME_RA3;
+  return Options::GAME_UNDEF;
+}
+
+bool ReplayStream::open(const char * filename, Options::GameType gametype)
+{
+  close();
+  gametype_ = Options::GAME_UNDEF;
+  first_ = pos_ = 0;
+
+  if (!(mapped_ = file_.open(filename))) return false;
+
+  const unsigned char * const b = file_.data();
+  const size_t size = file_.size();
+
+  switch (format_ = sniff_replay(b, size))
+  {
+  case REPLAY_CNC3:
+  case REPLAY_RA3:
+    gametype_ = gametype != Options::GAME_UNDEF ? gametype : sniff_game(b, size, game_from_filename(filename));
+    if (!parse_replay_header(b, size, gametype_, header_)) return false;
+    first_ = header_.firstchunk;
+    break;
+  case REPLAY_CNC4:
+    first_ = 0xFA8;
+    break;
+  case REPLAY_GENERALS:
+  case REPLAY_BFME:
+  case REPLAY_BFME2:
+    if (!parse_generals_header(b, size, format_, generals_header_)) return false;
+    first_ = generals_header_.firstchunk;
+    break;
+  default:
+    return false;
+  }
+
+  if (first_ > size) return false;
+
+  pos_ = first_;
+  return true;
+}
+
+ChunkStatus ReplayStream::next(replay_chunk_t & chunk)
+{
+  const unsigned char * const b = file_.data();
+  const size_t size = file_.size();
+
+  chunk.offset   = pos_;
+  chunk.timecode = 0;
+  chunk.type     = 0;
+  chunk.length   = 0;
+  chunk.data     = NULL;
+
+  switch (format_)
+  {
+  case REPLAY_CNC3:
+  case REPLAY_RA3:
+  {
+    ChunkReader reader(file_, pos_);
+    chunk_view_t view;
+    view.timecode = 0;
+    view.type     = 0;
+    const ChunkStatus status = reader.next(view);
+
+    /* As with ChunkReader, a truncated chunk has its header fields if they could be read. */
+    chunk.timecode = view.timecode;
+    chunk.type     = (unsigned char)(view.type);
+    chunk.length   = view.length;
+    chunk.data     = view.data;
+    pos_ = reader.position();
+    if (status == CHUNK_END)
+    {
+      chunk.data   = b + pos_;
+      chunk.length = uint32_t(size - pos_);
+    }
+    return status;
+  }
+
+  case REPLAY_CNC4:
+    if (pos_ + 8 > size) return CHUNK_TRUNCATED;
+
+    chunk.timecode = READ_UINT32LE(b + pos_);
+    chunk.type     = READ_UINT16LE(b[pos_ + 4], b[pos_ + 5]);
+    chunk.length   = READ_UINT16LE(b[pos_ + 6], b[pos_ + 7]);
+
+    if (chunk.timecode == 0xFFFFFFFF && chunk.type == 0xFFFF)
+    {
+      pos_ += 8;
+      chunk.data   = b + pos_;
+      chunk.length = uint32_t(std::min<size_t>(chunk.length, size - pos_));
+      return CHUNK_END;
+    }
+
+    if (size - (pos_ + 8) < chunk.length) return CHUNK_TRUNCATED;
+
+    chunk.data = b + pos_ + 8;
+    pos_ += 8 + chunk.length;
+    return CHUNK_OK;
+
+  case REPLAY_GENERALS:
+  case REPLAY_BFME:
+  case REPLAY_BFME2:
+  {
+    /* No terminator: the last chunk ends at the end of the file. */
+    if (pos_ == size) { chunk.data = b + pos_; return CHUNK_END; }
+    if (pos_ + 13 > size) return CHUNK_TRUNCATED;
+
+    chunk.timecode = READ_UINT32LE(b + pos_);
+    chunk.type     = READ_UINT32LE(b + pos_ + 4);
+
+    const unsigned char * const commands = b + pos_ + 13;
+    const size_t ncommands = b[pos_ + 12];
+    size_t length = 5 + 2 * ncommands;
+
+    if (size - (pos_ + 8) < length) return CHUNK_TRUNCATED;
+
+    for (size_t k = 0; k < ncommands; ++k)
+    {
+      const size_t argsize = generals_arg_size(commands[2 * k], format_);
+
+      if (argsize == 0)
+      {
+        /* Everything from here on, for the caller to look at. */
+        chunk.data   = b + pos_ + 8;
+        chunk.length = uint32_t(size - (pos_ + 8));
+        return CHUNK_INVALID;
+      }
+      length += argsize * commands[2 * k + 1];
+    }
+
+    if (size - (pos_ + 8) < length) return CHUNK_TRUNCATED;
+
+    chunk.data   = b + pos_ + 8;
+    chunk.length = uint32_t(length);
+    pos_ += 8 + length;
+    return CHUNK_OK;
+  }
+
+  default:
+    return CHUNK_INVALID;
+  }
+}
+
+std::unique_ptr<ReplayStream> open_replay(const char * filename, Options::GameType gametype)
+{
+  std::unique_ptr<ReplayStream> replay(new ReplayStream);
+  if (!replay->open(filename, gametype)) replay.reset();
+  return replay;
+}
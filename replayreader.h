@@ -15,16 +15,46 @@
 #include <iomanip>
 #include <iterator>
 #include <vector>
+#include <deque>
 #include <map>
 #include <set>
+#include <memory>
 #include <algorithm>
+#include <numeric>
 #include <stdexcept>
+#include <exception>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
+#include <cerrno>
 #include <ctime>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 #include <stdint.h>
 #include <getopt.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define READ_UINT16LE(a, b)  ( ((unsigned int)(b)<<8) | ((unsigned int)(a)) )
 #define READ_UINT32LE(in) ( (unsigned int)((in)[0] | ((in)[1] << 8) | ((in)[2] << 16) | ((in)[3] << 24)) )
 #define READ(f, x) do { f.read(reinterpret_cast<char*>(&x), sizeof(x)); } while (false)
@@ -85,11 +115,14 @@ typedef struct _apm_t
 struct Options
 {
   enum GameType { GAME_UNDEF = 0, GAME_KW, GAME_TW, GAME_RA3 };
+  enum ExportFormat { EXPORT_NONE = 0, EXPORT_NDJSON, EXPORT_CSV };
 
   Options() : type(), cmd_filter(), time_series_filter(), fixpos(0), fixfn(NULL), audiofn(NULL),
-              autofix(false), breakonerror(false), dumpchunks(false), dumpchunkswithraw(false),
+              autofix(false), fix_in_place(false), breakonerror(false), dumpchunks(false), dumpchunkswithraw(false),
               dumpaudio(false), filter_heartbeat(-1), printraw(false),
-              apm(false), fixbroken(false), gametype(GAME_UNDEF), verbose(false) {}
+              apm(false), apm_window(0), validate(false), catalog(false), build_index(false), from_tc(0), to_tc(UINT32_MAX),
+              export_format(EXPORT_NONE), columnsfn(NULL), scan_columns(false), cachefn(NULL), watch(false), follow(false),
+              fixbroken(false), gametype(GAME_UNDEF), verbose(false), jobs(1) {}
 
   std::set<int> type;
   std::set<int> cmd_filter;
@@ -98,6 +131,7 @@ struct Options
   const char * fixfn;
   const char * audiofn;
   bool autofix;
+  bool fix_in_place;
   bool breakonerror;
   bool dumpchunks;
   bool dumpchunkswithraw;
@@ -105,18 +139,306 @@ struct Options
   int  filter_heartbeat;
   bool printraw;
   bool apm;
+  uint32_t apm_window;
+  bool validate;
+  bool catalog;
+  bool build_index;
+  uint32_t from_tc;
+  uint32_t to_tc;
+  ExportFormat export_format;
+  const char * columnsfn;
+  bool scan_columns;
+  const char * cachefn;
+  bool watch;
+  bool follow;
   bool fixbroken;
   GameType gametype;
   bool verbose;
+  unsigned int jobs;
 };
 
 typedef std::map<unsigned int, unsigned int> apm_1_map_t;
 typedef std::map<unsigned int, apm_t>        apm_2_map_t;
-//typedef std::map<int, std::map<unsigned int, unsigned int> > apm_histo_map_t;
-typedef std::map<int, std::map<unsigned int, std::multiset<unsigned int>>> apm_histo_map_t;
 
-typedef std::map<unsigned int, int> command_map_t;
-typedef std::map<unsigned int, std::string> command_names_t;
+/** Type-1 command statistics: For each raw player byte and each command byte,
+ *  the timecodes at which the command was issued. Chunks come in timecode order,
+ *  so every list is append-only and stays sorted. The 256 command slots of a
+ *  player are only allocated once that player issues a command.
+ */
+struct ApmHistogram
+{
+  typedef std::vector<unsigned int> timecodes_t;
+
+  struct player_t
+  {
+    timecodes_t commands[256];
+  };
+
+  void record(unsigned int player, unsigned int cmd_id, unsigned int timecode)
+  {
+    std::unique_ptr<player_t> & p = players[player & 0xFF];
+    if (!p) p.reset(new player_t);
+    p->commands[cmd_id & 0xFF].push_back(timecode);
+  }
+
+  const player_t * player(unsigned int n) const { return players[n].get(); }
+
+  /** Appends the statistics of a later stretch of the same replay. */
+  void append(const ApmHistogram & later)
+  {
+    for (unsigned int p = 0; p < 256; ++p)
+    {
+      if (!later.players[p]) continue;
+      if (!players[p]) players[p].reset(new player_t);
+
+      for (unsigned int c = 0; c < 256; ++c)
+      {
+        const timecodes_t & src = later.players[p]->commands[c];
+        players[p]->commands[c].insert(players[p]->commands[c].end(), src.begin(), src.end());
+      }
+    }
+  }
+
+  std::unique_ptr<player_t> players[256];
+};
+
+
+/** Type-1 command tables: lengths and names. */
+const int16_t CMD_UNKNOWN = INT16_MIN;
+typedef int16_t      command_table_t[256];
+typedef const char * command_name_table_t[256];
+
+inline const char * command_name(const command_name_table_t & names, unsigned int cmd_id)
+{
+  return names[cmd_id & 0xFF] == NULL ? "" : names[cmd_id & 0xFF];
+}
+
+/** Type-1 command tables, indexed by the command byte; see cnc3reader_impl.cpp. */
+extern const command_table_t RA3_commands;
+extern const command_table_t KW_commands;
+extern const command_table_t TW_commands;
+extern const command_name_table_t RA3_cmd_names;
+extern const command_name_table_t KW_cmd_names;
+extern const command_name_table_t TW_cmd_names;
+
+/** Per-game properties of TW/KW/RA3. The type-1 chunk dissector is a template
+ *  over these, so each game gets a loop with its own command table and its own
+ *  special-length commands compiled in, without checking the game type per command.
+ *
+ *  mangle_player() computes the player number 0, 1, 2, ... from the player number
+ *  in the type-1 chunk commands, 0x19, 0x1A, etc.
+ *
+ *  apm_counted() filters out commands that are not player actions:
+ *
+ *    RA3: 0x37: some automatic, irregular sync command ("scroll"??)
+ *         0x21: hearbeat, every 3 seconds
+ *    KW:  0x8F: some automatic, irregular sync command ("scroll"??)
+ *         0x61: heartbeat, every 30 seconds
+ *    TW:  0x85: some automatic, irregular sync command ("scroll"??)
+ *         0x57: heartbeat, every 30 seconds
+ *
+ *  special_length() is the length of a special-length command (table entry 0) starting
+ *  at buf[pos], or 0 if we don't know how to work it out. uuid_command is the special-length
+ *  command carrying two strings and a number (see uuid_command_length()).
+ *
+ *  Of the remaining commands, all games have 0xF5 (drag selection box and/or select units;
+ *  we could micro-filter this depending on how many units got selected) and 0xF8 (left-click
+ *  on the map, can be used to "deselect" a selected unit, but is also caused by dumb blank
+ *  clicks), which are counted separately as "clicks".
+ */
+struct TW_traits
+{
+  static const Options::GameType game = Options::GAME_TW;
+
+  static const int16_t * commands() { return TW_commands; }
+  static const command_name_table_t & command_names() { return TW_cmd_names; }
+  static unsigned int mangle_player(unsigned int n) { return n / 8 - 3; }
+  static bool apm_counted(unsigned int c) { return c != 0x85 && c != 0x57; }
+
+  static const unsigned int uuid_command = 0x81;
+  static size_t special_length(const unsigned char * buf, size_t pos, size_t chunklen);
+};
+
+struct KW_traits
+{
+  static const Options::GameType game = Options::GAME_KW;
+
+  static const int16_t * commands() { return KW_commands; }
+  static const command_name_table_t & command_names() { return KW_cmd_names; }
+  static unsigned int mangle_player(unsigned int n) { return n / 8 - 3; }
+  static bool apm_counted(unsigned int c) { return c != 0x8F && c != 0x61; }
+
+  static const unsigned int uuid_command = 0x8B;
+  static size_t special_length(const unsigned char * buf, size_t pos, size_t chunklen);
+};
+
+struct RA3_traits
+{
+  static const Options::GameType game = Options::GAME_RA3;
+
+  static const int16_t * commands() { return RA3_commands; }
+  static const command_name_table_t & command_names() { return RA3_cmd_names; }
+  static unsigned int mangle_player(unsigned int n) { return n / 8 - 2; }
+  static bool apm_counted(unsigned int c) { return c != 0x21 && c != 0x37; }
+
+  static const unsigned int uuid_command = 0x33;
+  static size_t special_length(const unsigned char * buf, size_t pos, size_t chunklen);
+};
+
+/** Run-time dispatch to the traits above, for the (not performance-critical) reports.
+ */
+inline unsigned int mangle_player(unsigned int n, Options::GameType gametype)
+{
+  return gametype == Options::GAME_RA3 ? RA3_traits::mangle_player(n) : TW_traits::mangle_player(n);
+}
+
+inline bool apm_counted(unsigned int cmd_id, Options::GameType gametype)
+{
+  switch (gametype)
+  {
+  case Options::GAME_TW:  return TW_traits::apm_counted(cmd_id);
+  case Options::GAME_KW:  return KW_traits::apm_counted(cmd_id);
+  case Options::GAME_RA3: return RA3_traits::apm_counted(cmd_id);
+  default:                return false;
+  }
+}
+
+/** APM over time: for each (mangled) player, the prefix sums over all frames of the
+ *  actions that count towards the APM, with and without the clicks 0xF8 and 0xF5.
+ *  After build(), the actions in any stretch of the game are a single subtraction,
+ *  so windows, buckets and the peak over all windows are cheap.
+ */
+class ApmTimeline
+{
+public:
+  ApmTimeline() : frames(0) { }
+
+  void build(const ApmHistogram & histo, Options::GameType gametype, unsigned int final_timecode);
+
+  unsigned int length() const { return frames; }
+  std::vector<unsigned int> players() const;
+
+  /** The actions of player p in the frames [from, to). */
+  unsigned int actions(unsigned int p, unsigned int from, unsigned int to, bool clicks = true) const;
+  double apm(unsigned int p, unsigned int from, unsigned int to, bool clicks = true) const;
+
+  /** The busiest "window" frames of player p: the APM in them, and the first frame in "start". */
+  double peak_apm(unsigned int p, unsigned int window, unsigned int & start, bool clicks = true) const;
+
+private:
+  typedef std::vector<unsigned int> sums_t;   // frames + 1 entries, sums[t] = actions before frame t
+
+  const sums_t * sums(unsigned int p, bool clicks) const;
+
+  unsigned int frames;
+  std::map<unsigned int, sums_t> with_clicks, without_clicks;
+};
+
+
+/**** Events of the type-1 chunk decoder. ****/
+
+/** A single type-1 chunk command. "data" points at the command byte, and the command
+ *  spans "length" bytes up to and including its 0xFF terminator. A length of 0 means
+ *  that the command could not be decoded; the decoder gives up on the chunk after it.
+ */
+typedef struct _command_event_t
+{
+  unsigned int timecode;
+  unsigned int counter;        // 1, 2, ... within the chunk
+  unsigned int cmd_id;
+  unsigned int player;
+  int          table_len;      // the command table entry: fixed length, -cmd_len_byte, or 0 (special)
+  bool         recognized;     // false for special-length commands that were only skipped to the terminator
+  const unsigned char * data;
+  size_t       length;
+} command_event_t;
+
+/** The decoder is a template over its sink, which receives the events. NullSink
+ *  ignores all of them; sinks derive from it and override what they need, and
+ *  the events nobody listens to compile to nothing. player_chunk() is a type-2
+ *  chunk, with "buf" pointing at its data.
+ */
+struct NullSink
+{
+  void chunk1_begin(const unsigned char * /* buf */, size_t /* chunklen */, unsigned int /* timecode */,
+                    unsigned int /* block_count */, size_t /* ncommands */) { }
+  void command(const command_event_t & /* ev */) { }
+  void chunk1_end() { }
+  void player_chunk(unsigned int /* player_id */, const unsigned char * /* buf */, size_t /* chunklen */,
+                    unsigned int /* timecode */, unsigned int /* block_count */) { }
+};
+
+/** Gathers the APM statistics: every type-1 command, and the type-2 chunk counters. */
+struct ApmSink : public NullSink
+{
+  ApmSink(ApmHistogram & h, apm_2_map_t & p2) : histo(h), player_2_apm(p2) { }
+
+  void command(const command_event_t & ev) { histo.record(ev.player, ev.cmd_id, ev.timecode); }
+
+  // Counters: 0 - heartbeat, 1 - other 40 byte, 2 - 24 byte
+  void player_chunk(unsigned int player_id, const unsigned char * /* buf */, size_t chunklen,
+                    unsigned int timecode, unsigned int /* block_count */)
+  {
+    if (chunklen == 40 && (timecode % 15 == 0 || timecode == 1)) player_2_apm[player_id].counter[0]++;
+    else if (chunklen == 40) player_2_apm[player_id].counter[1]++;
+    else if (chunklen == 24) player_2_apm[player_id].counter[2]++;
+    else                     player_2_apm[player_id].counter[3]++;
+  }
+
+  ApmHistogram & histo;
+  apm_2_map_t  & player_2_apm;
+};
+
+/** The running APM of every player for --follow: the counted commands so far, and the
+ *  time codes of those in the last minute (900 frames) of the game.
+ */
+struct LiveApmSink : public NullSink
+{
+  explicit LiveApmSink(Options::GameType g) : gametype(g) { std::fill(total, total + 256, 0U); }
+
+  void command(const command_event_t & ev)
+  {
+    if (ev.length == 0 || !apm_counted(ev.cmd_id, gametype)) return;
+
+    const unsigned int p = mangle_player(ev.player, gametype) & 0xFF;
+    total[p]++;
+    recent[p].push_back(ev.timecode);
+  }
+
+  /** Forgets the commands that are more than a minute older than "now". */
+  void trim(unsigned int now)
+  {
+    for (unsigned int p = 0; p < 256; ++p)
+      while (!recent[p].empty() && recent[p].front() + 900 < now) recent[p].pop_front();
+  }
+
+  Options::GameType gametype;
+  unsigned int total[256];
+  std::deque<unsigned int> recent[256];
+};
+
+/** Feeds the events to two sinks, in order. */
+template <typename A, typename B>
+struct SinkPair
+{
+  SinkPair(A & a_, B & b_) : a(a_), b(b_) { }
+
+  void chunk1_begin(const unsigned char * buf, size_t chunklen, unsigned int timecode, unsigned int block_count, size_t ncommands)
+  {
+    a.chunk1_begin(buf, chunklen, timecode, block_count, ncommands);
+    b.chunk1_begin(buf, chunklen, timecode, block_count, ncommands);
+  }
+  void command(const command_event_t & ev) { a.command(ev); b.command(ev); }
+  void chunk1_end() { a.chunk1_end(); b.chunk1_end(); }
+  void player_chunk(unsigned int player_id, const unsigned char * buf, size_t chunklen, unsigned int timecode, unsigned int block_count)
+  {
+    a.player_chunk(player_id, buf, chunklen, timecode, block_count);
+    b.player_chunk(player_id, buf, chunklen, timecode, block_count);
+  }
+
+  A & a;
+  B & b;
+};
 
 
 /* Checks if a given number of bytes are all zero.
@@ -130,6 +452,656 @@ inline bool array_is_zero(const unsigned char * data, size_t n)
 }
 
 
+/**** Zero-copy access to the replay body. ****/
+
+
+/** Chunk buffers are followed by at least CHUNK_PADDING readable zero bytes, so the
+ *  decoders may peek a short, fixed distance past any position inside a chunk
+ *  without a bounds check, even in a malformed replay that ends right there.
+ */
+const size_t CHUNK_PADDING = 512;
+
+/** A read-only view of an entire file. On POSIX systems the file is mmap()ed,
+ *  elsewhere it is read into memory once. Either way the chunk data can be
+ *  handed out as pointers into this view, without per-chunk copies, and the
+ *  view is followed by CHUNK_PADDING zero bytes.
+ */
+class MappedFile
+{
+public:
+  MappedFile() : data_(NULL), size_(0), mapped_(0) {}
+  ~MappedFile() { close(); }
+
+  bool open(const char * filename);
+  void close();
+
+  const unsigned char * data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile & operator=(const MappedFile &);
+
+  const unsigned char * data_;
+  size_t size_;
+  size_t mapped_;
+#ifdef _WIN32
+  std::vector<unsigned char> buffer_;
+#endif
+};
+
+
+/** A single chunk of the TW/KW/RA3 replay body, pointing into a MappedFile.
+ *  The "data" pointer is valid for length + 4 bytes, i.e. it includes the
+ *  trailing zero uint32 which follows every chunk.
+ */
+typedef struct _chunk_view_t
+{
+  uint32_t              timecode;
+  char                  type;
+  uint32_t              length;
+  const unsigned char * data;
+  size_t                offset;   // file offset of the chunk header
+} chunk_view_t;
+
+enum ChunkStatus { CHUNK_OK = 0, CHUNK_END, CHUNK_TRUNCATED, CHUNK_INVALID };
+
+/** Walks the chunk framing of a TW/KW/RA3 replay body:
+ *
+ *    { uint32 timecode; byte type; uint32 length; byte[length] data; uint32 zero; }
+ *
+ *  until the terminating timecode 0x7FFFFFFF. next() returns CHUNK_END at the
+ *  terminator (and pos then points past it), or CHUNK_TRUNCATED if the file
+ *  ends before the current chunk is complete; in that case the chunk header
+ *  fields are filled in if they could be read at all (length is 0 otherwise).
+ */
+class ChunkReader
+{
+public:
+  ChunkReader(const MappedFile & file, size_t start) : begin(file.data()), end(file.data() + file.size()), pos(start) {}
+  ChunkReader(const unsigned char * data, size_t size, size_t start) : begin(data), end(data + size), pos(start) {}
+
+  ChunkStatus next(chunk_view_t & chunk);
+  size_t position() const { return pos; }
+  void seek(size_t p) { pos = p; }
+
+private:
+  const unsigned char * begin;
+  const unsigned char * end;
+  size_t pos;
+};
+
+/** Where the chunk walk of a replay ends, found from its tail: replays are written
+ *  in 4 KiB blocks, so the last complete chunk sits in the final few blocks. There,
+ *  two consecutive plausible chunk frames anchor the framing, and the walk goes on
+ *  from them. Only if that fails is the whole body walked from "firstchunk".
+ *  Returns CHUNK_END or CHUNK_TRUNCATED; "lastgood" is the offset of the last
+ *  complete chunk, or 0 if there is none.
+ */
+ChunkStatus find_last_chunk(const MappedFile & file, size_t firstchunk, size_t & lastgood);
+
+
+/** A chunk index of a replay: time code, file offset, length and type of every chunk.
+ *  It is kept next to the replay in "<replay>.idx" and is only used while the replay
+ *  still has the size, modification time and first chunk offset recorded in it.
+ *  The sidecar is the 40-byte chunk_index_header_t followed by the entries, all in
+ *  native byte order, and is mapped into memory as it is.
+ */
+typedef struct _chunk_index_header_t
+{
+  char     magic[8];          // "CNC3IDX\0"
+  uint32_t version;           // 1
+  uint32_t count;             // number of entries
+  uint64_t replay_size;
+  int64_t  replay_mtime;
+  uint32_t firstchunk;
+  uint32_t end;               // offset of the terminator, or of the truncated chunk
+} chunk_index_header_t;
+
+typedef struct _chunk_index_entry_t
+{
+  uint32_t timecode;
+  uint32_t offset;
+  uint32_t length;
+  uint8_t  type;
+  uint8_t  pad[3];
+} chunk_index_entry_t;
+
+class ChunkIndex
+{
+public:
+  ChunkIndex() : entries(NULL), count(0), end_(0) {}
+
+  /** Maps "<replay>.idx" if it exists and is up to date. */
+  bool load(const char * replay, uint32_t firstchunk);
+
+  /** Walks the chunks of the mapped replay, and writes the sidecar. Failing to
+   *  write it is not an error, the index is just rebuilt next time.
+   */
+  void build(const MappedFile & file, uint32_t firstchunk);
+  bool save(const char * replay, uint32_t firstchunk) const;
+
+  size_t size() const { return count; }
+  const chunk_index_entry_t & operator[](size_t i) const { return entries[i]; }
+
+  /** Where the chunk walk ends: the terminator, or the truncated chunk. */
+  size_t end() const { return end_; }
+
+  /** The first chunk with a time code of at least "timecode"; size() if there is none.
+   *  Time codes never decrease along the replay, so this is a binary search.
+   */
+  size_t lower_bound(uint32_t timecode) const;
+
+private:
+  static std::string sidecar_name(const char * replay) { return std::string(replay) + ".idx"; }
+
+  MappedFile sidecar;
+  std::vector<chunk_index_entry_t> built;
+  const chunk_index_entry_t * entries;
+  size_t count;
+  size_t end_;
+};
+
+/** Scratch memory for chunks that are copied out of a stream rather than mapped, as
+ *  in --follow: alloc() hands out pieces of one growing region, and reset() takes
+ *  them all back at once. When a region runs out, the pieces already handed out stay
+ *  where they are and a further region is started; the next reset() replaces all
+ *  regions by a single one of their combined size. After the first few rounds, there
+ *  is no more heap traffic at all.
+ */
+class ChunkArena
+{
+public:
+  ChunkArena() : used(0) { }
+
+  unsigned char * alloc(size_t n)
+  {
+    n = (n + 15) & ~size_t(15);
+    if (regions.empty() || used + n > regions.back().size)
+    {
+      region_t r;
+      r.size = std::max(n, regions.empty() ? size_t(65536) : 2 * regions.back().size);
+      r.data.reset(new unsigned char[r.size]);
+      regions.push_back(std::move(r));
+      used = 0;
+    }
+
+    unsigned char * const p = regions.back().data.get() + used;
+    used += n;
+    return p;
+  }
+
+  void reset()
+  {
+    if (regions.size() > 1)
+    {
+      size_t total = 0;
+      for (size_t i = 0; i != regions.size(); ++i) total += regions[i].size;
+      regions.clear();
+
+      region_t r;
+      r.size = total;
+      r.data.reset(new unsigned char[total]);
+      regions.push_back(std::move(r));
+    }
+    used = 0;
+  }
+
+  size_t capacity() const { return regions.empty() ? 0 : regions.back().size; }
+
+private:
+  ChunkArena(const ChunkArena &);
+  ChunkArena & operator=(const ChunkArena &);
+
+  struct region_t
+  {
+    std::unique_ptr<unsigned char[]> data;
+    size_t size;
+  };
+
+  std::vector<region_t> regions;
+  size_t used;
+};
+
+
+/**** Result cache. ****/
+
+
+/** What identifies a replay for the result cache: device, inode, size and modification
+ *  time, and a hash of its first 4 KiB, which hold the header.
+ */
+typedef struct _file_identity_t
+{
+  uint64_t dev, ino, size;
+  int64_t  mtime;
+  uint64_t head_hash;
+} file_identity_t;
+
+bool file_identity(const char * filename, file_identity_t & id);
+
+/** The output of earlier runs, per file name and mode (a string that captures the
+ *  options the output depends on). An entry is only used while its file still has
+ *  the identity it was recorded with. All members may be called from several threads.
+ */
+class ResultCache
+{
+public:
+  /** Reads the cache file; a missing or unreadable cache is just empty. */
+  void load(const char * filename);
+  bool save(const char * filename) const;
+
+  bool lookup(const std::string & file, const std::string & mode, const file_identity_t & id,
+              std::string & out, std::string & err, bool & res) const;
+  void store(const std::string & file, const std::string & mode, const file_identity_t & id,
+             const std::string & out, const std::string & err, bool res);
+
+private:
+  typedef struct _entry_t
+  {
+    file_identity_t id;
+    bool res;
+    std::string out, err;
+  } entry_t;
+
+  std::map<std::pair<std::string, std::string>, entry_t> entries;
+  mutable std::mutex mx;
+};
+
+
+/**** Repairing truncated replays. ****/
+
+
+/** Writes the first "n" bytes of "from" to a new file "to", followed by "tail".
+ *  On Linux the copy stays in the kernel (copy_file_range), and file systems
+ *  with reflinks share the blocks instead of copying them.
+ */
+bool copy_file_prefix(const char * from, const char * to, uint64_t n, const void * tail, size_t taillen);
+
+/** Cuts "filename" off after "n" bytes and appends "tail", in place. Not available on Windows.
+ */
+bool truncate_and_append(const char * filename, uint64_t n, const void * tail, size_t taillen);
+
+
+/**** Columnar command files. ****/
+
+
+/** Decoded type-1 commands and type-2 chunks of one or more replays, one row each,
+ *  stored column by column so that analyses can scan them straight from a mapping:
+ *
+ *    header | files | tc_delta | tc_escape | kind | player | cmd | payload_offset | payload_length | payload | names
+ *
+ *  Every column starts on an 8-byte boundary. Time codes are stored as the difference
+ *  to the previous row of the same file (the first row of a file counts from 0); a
+ *  difference of 0xFFFF or more is stored as 0xFFFF, and the full time code is then
+ *  the next entry of tc_escape. "kind" is the chunk type (1 or 2), "player" the player
+ *  number (mangle_player() for commands), "cmd" the command byte (0 for type 2). The
+ *  payload is the command bytes, or the type-2 data after its 11-byte preamble.
+ */
+typedef struct _column_file_header_t
+{
+  char     magic[8];          // "CNC3COL\0"
+  uint32_t version;           // 2
+  uint32_t nfiles;
+  uint64_t nrows;
+  uint64_t nescapes;
+  uint64_t payload_size;
+  uint64_t names_size;
+  uint64_t off_files, off_tc_delta, off_tc_escape, off_kind, off_player, off_cmd,
+           off_payload_offset, off_payload_length, off_payload, off_names;
+} column_file_header_t;
+
+typedef struct _column_file_entry_t
+{
+  uint64_t first_row;
+  uint64_t nrows;
+  uint64_t first_escape;      // the file's first entry in tc_escape
+  uint32_t name_offset;       // into "names", NUL-terminated
+  uint32_t final_timecode;    // the length of the replay, whatever rows were stored
+  uint8_t  gametype;          // Options::GameType
+  uint8_t  pad[7];
+} column_file_entry_t;
+
+class ColumnWriter
+{
+public:
+  ColumnWriter() : last_tc(0) {}
+
+  void add_file(const char * name, Options::GameType gametype, uint32_t final_timecode);
+  void add_row(uint32_t timecode, uint8_t kind, uint8_t player, uint8_t cmd, const unsigned char * payload, size_t length);
+  bool write(const char * filename) const;
+
+private:
+  std::vector<column_file_entry_t> files;
+  std::vector<uint16_t> tc_delta, payload_length;
+  std::vector<uint32_t> tc_escape;
+  std::vector<uint8_t>  kind, player, cmd;
+  std::vector<uint64_t> payload_offset;
+  std::vector<unsigned char> payload;
+  std::string names;
+  uint32_t last_tc;
+};
+
+class ColumnFile
+{
+public:
+  ColumnFile() : h(NULL) {}
+
+  /** Maps the file and checks that all columns lie within it. */
+  bool open(const char * filename);
+
+  size_t nfiles() const { return h->nfiles; }
+  size_t nrows() const { return h->nrows; }
+
+  const column_file_entry_t & file(size_t i) const { return column<column_file_entry_t>(h->off_files)[i]; }
+  const char * file_name(size_t i) const { return column<char>(h->off_names) + file(i).name_offset; }
+
+  const uint16_t * tc_delta() const { return column<uint16_t>(h->off_tc_delta); }
+  const uint32_t * tc_escape() const { return column<uint32_t>(h->off_tc_escape); }
+  const uint8_t  * kind() const { return column<uint8_t>(h->off_kind); }
+  const uint8_t  * player() const { return column<uint8_t>(h->off_player); }
+  const uint8_t  * cmd() const { return column<uint8_t>(h->off_cmd); }
+  const uint64_t * payload_offset() const { return column<uint64_t>(h->off_payload_offset); }
+  const uint16_t * payload_length() const { return column<uint16_t>(h->off_payload_length); }
+  const unsigned char * payload() const { return column<unsigned char>(h->off_payload); }
+
+  /** The time codes of the rows of file i, from the deltas and escapes. */
+  void timecodes(size_t i, std::vector<uint32_t> & out) const;
+
+private:
+  template <typename T> const T * column(uint64_t off) const { return reinterpret_cast<const T *>(mapped.data() + off); }
+
+  MappedFile mapped;
+  const column_file_header_t * h;
+};
+
+
+/**** Header and footer, parsed from memory. ****/
+
+
+/** Reads the first "headmax" and the last "tailmax" bytes of a file (fewer if the
+ *  file is smaller) with one positioned read each, without going through a stream.
+ */
+bool read_head_and_tail(const char * filename, size_t headmax, size_t tailmax,
+                        std::vector<unsigned char> & head, std::vector<unsigned char> & tail, uint64_t & filesize);
+
+/** An entry of the "S=" header field: a human player ("H" entries) or a computer
+ *  opponent ("C" entries, whose name is "CE", "CM", "CH", ... for the difficulty).
+ */
+typedef struct _replay_player_t
+{
+  bool computer;
+  std::string name;
+  int  faction;
+  std::vector<std::string> fields;   // the whole entry, split at the commas
+} replay_player_t;
+
+/** The header of a TW/KW/RA3 replay, up to and including the header string.
+ */
+typedef struct _replay_header_t
+{
+  Options::GameType gametype;
+  unsigned int vermajor, verminor, buildmajor, buildminor;
+  unsigned char number1, six;
+  std::string title, description, mapname, mapid;
+  std::vector<uint32_t>    team_ids;
+  std::vector<std::string> team_names;
+  uint32_t firstchunk;
+  uint32_t timestamp;
+  std::string header_string;
+  std::vector<replay_player_t> players;
+} replay_header_t;
+
+/** The footer: the final time code, the raw footer data, and the six kill/death
+ *  ratios if the data has the usual size (empty otherwise).
+ */
+typedef struct _replay_footer_t
+{
+  uint32_t final_timecode;
+  std::vector<unsigned char> data;
+  std::vector<float> kill_death;
+} replay_footer_t;
+
+/** Parse the header from the start of the file, and the footer from the end of the file.
+ *  "gametype" may be GAME_UNDEF, in which case the header parser recognises RA3 by its
+ *  magic string and otherwise makes the same guess (TW or KW) as the stream parser.
+ *  Both return false if the data is not what we expect.
+ */
+bool parse_replay_header(const unsigned char * buf, size_t len, Options::GameType gametype, replay_header_t & h);
+bool parse_replay_footer(const unsigned char * tail, size_t len, Options::GameType gametype, replay_footer_t & f);
+
+/** The magic strings that end a TW/KW and an RA3 replay. */
+extern const char FOOTERCC[], FOOTERRA3[];
+
+
+/**** All replay formats behind one chunk stream. ****/
+
+
+enum ReplayFormat { REPLAY_UNKNOWN = 0, REPLAY_CNC3, REPLAY_RA3, REPLAY_CNC4, REPLAY_GENERALS, REPLAY_BFME, REPLAY_BFME2 };
+
+/** Recognises a replay by the magic at its start; SNIFF_BYTES are enough for all of them.
+ *  TW and KW share their magic, so REPLAY_CNC3 stands for both.
+ */
+const size_t SNIFF_BYTES = 32;
+ReplayFormat sniff_replay(const unsigned char * buf, size_t len);
+const char * replay_format_name(ReplayFormat f);
+
+/** Guess the game type from the file name suffix; GAME_UNDEF if there is no known suffix.
+ *  This is only a hint for sniff_game(), which reads the game off the data.
+ */
+Options::GameType game_from_filename(const char * filename);
+
+/** The game of a TW/KW/RA3 replay, told from the start of the file rather than its name:
+ *  RA3 by its magic, TW 1.07+ by the mod info after the header. Other C&C3 replays are
+ *  KW, unless "hint" (the file suffix, say) is TW, as TW before 1.07 wrote no mod info.
+ *  GAME_UNDEF if the data is not a TW/KW/RA3 replay, or "hint" if its header is cut off.
+ */
+Options::GameType sniff_game(const unsigned char * head, size_t len, Options::GameType hint = Options::GAME_UNDEF);
+
+/** The size of one argument of a Generals/ZH/BFME command argument type, 0 if the type is unknown. */
+size_t generals_arg_size(unsigned int type, ReplayFormat f);
+
+/** A chunk of any replay format, pointing into the mapped file. "type" is the chunk
+ *  type of TW/KW/RA3, the second word of CnC4 chunks, and the command of Generals/ZH/BFME,
+ *  whose "data" starts at the command number and covers the argument list. At CHUNK_END,
+ *  "data" and "length" describe the footer.
+ */
+typedef struct _replay_chunk_t
+{
+  uint32_t              timecode;
+  uint32_t              type;
+  uint32_t              length;
+  const unsigned char * data;
+  size_t                offset;   // file offset of the chunk header
+} replay_chunk_t;
+
+/** The header of a Generals/ZH/BFME replay, up to the first chunk.
+ */
+typedef struct _generals_header_t
+{
+  uint32_t time1, time2;
+  std::string filename;
+  date_text_t datetime;
+  std::string version, builddate;
+  uint16_t verminor, vermajor;
+  unsigned char numbers[8];
+  unsigned char bfmenumbers[5];     // BFME and BFME2 only
+  std::string asciiheader;
+  uint16_t x;
+  uint32_t y[4];
+  uint32_t z[2];                    // BFME2 only
+  uint32_t firstchunk;
+} generals_header_t;
+
+bool parse_generals_header(const unsigned char * buf, size_t len, ReplayFormat f, generals_header_t & h);
+
+/** A replay of any of the supported games, mapped into memory: open() recognises the
+ *  format, parses the header (TW/KW/RA3 and Generals/ZH/BFME; CnC4 chunks always start
+ *  at 0xFA8), and next() then walks the chunks until CHUNK_END. CHUNK_TRUNCATED means
+ *  the file ends inside a chunk, CHUNK_INVALID that a chunk cannot be framed (a Generals
+ *  command with an unknown argument type; "data" then runs to the end of the file).
+ *
+ *  A TW/KW/RA3 game type of GAME_UNDEF is told by sniff_game(), with the file suffix as
+ *  the hint. If the header does not parse, open() returns false, but the file stays
+ *  mapped (is_mapped()), and format(), gametype() and seek() still work, for readers
+ *  that make sense of a damaged header themselves.
+ */
+class ReplayStream
+{
+public:
+  ReplayStream() : mapped_(false), format_(REPLAY_UNKNOWN), gametype_(Options::GAME_UNDEF), first_(0), pos_(0) {}
+
+  bool open(const char * filename, Options::GameType gametype = Options::GAME_UNDEF);
+  void close() { file_.close(); mapped_ = false; format_ = REPLAY_UNKNOWN; }
+
+  bool is_mapped() const { return mapped_; }
+  ReplayFormat format() const { return format_; }
+  Options::GameType gametype() const { return gametype_; }
+  const replay_header_t & header() const { return header_; }                       // TW/KW/RA3 only
+  const generals_header_t & generals_header() const { return generals_header_; }   // Generals/ZH/BFME only
+  const MappedFile & file() const { return file_; }
+  size_t first_chunk() const { return first_; }
+  size_t position() const { return pos_; }
+
+  void rewind() { pos_ = first_; }
+  void seek(size_t pos) { pos_ = pos; }
+  ChunkStatus next(replay_chunk_t & chunk);
+
+private:
+  ReplayStream(const ReplayStream &);
+  ReplayStream & operator=(const ReplayStream &);
+
+  MappedFile file_;
+  bool mapped_;
+  ReplayFormat format_;
+  Options::GameType gametype_;
+  replay_header_t header_;
+  generals_header_t generals_header_;
+  size_t first_;
+  size_t pos_;
+};
+
+/** Opens a replay for streaming, NULL if it cannot be read or is not a replay. */
+std::unique_ptr<ReplayStream> open_replay(const char * filename, Options::GameType gametype = Options::GAME_UNDEF);
+
+
+/**** Output helpers. ****/
+
+
+/** An ostream that writes through to a C stdio FILE. Mixing it with fprintf()
+ *  calls on the same FILE keeps the output in program order, just like mixing
+ *  std::cout and stdout does, but it works for any FILE, e.g. an in-memory one.
+ */
+class FileStreamBuf : public std::streambuf
+{
+public:
+  explicit FileStreamBuf(FILE * f) : file(f) {}
+
+protected:
+  virtual int_type overflow(int_type c)
+  {
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    return std::fputc(c, file) == EOF ? traits_type::eof() : c;
+  }
+  virtual std::streamsize xsputn(const char * s, std::streamsize n) { return std::fwrite(s, 1, n, file); }
+  virtual int sync() { return std::fflush(file) == 0 ? 0 : -1; }
+
+private:
+  FILE * file;
+};
+
+class FileOStream : public std::ostream
+{
+public:
+  explicit FileOStream(FILE * f) : std::ostream(NULL), buf(f) { rdbuf(&buf); }
+
+private:
+  FileStreamBuf buf;
+};
+
+/** An istream over bytes in memory, typically a MappedFile, for the parsers that read a
+ *  header field by field. Seeking works as on a file; reading past the end fails.
+ */
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+  MemoryStreamBuf(const unsigned char * data, size_t size)
+  {
+    char * const p = const_cast<char *>(reinterpret_cast<const char *>(data));
+    setg(p, p, p + size);
+  }
+
+protected:
+  virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+  {
+    const off_type base = dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? gptr() - eback() : egptr() - eback();
+    return seekpos(pos_type(base + off), which);
+  }
+
+  virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+  {
+    if (!(which & std::ios_base::in) || off_type(pos) < 0) return pos_type(off_type(-1));
+    setg(eback(), eback() + std::min<off_type>(off_type(pos), egptr() - eback()), egptr());
+    return pos;
+  }
+};
+
+class MemoryIStream : public std::istream
+{
+public:
+  explicit MemoryIStream(const MappedFile & f) : std::istream(NULL), buf(f.data(), f.size()) { rdbuf(&buf); }
+
+private:
+  MemoryStreamBuf buf;
+};
+
+/** A write buffer for machine-readable records, with number formatting that neither
+ *  allocates nor goes through printf. Full buffers go to the FILE in one fwrite().
+ */
+class RecordBuffer
+{
+public:
+  explicit RecordBuffer(FILE * f) : file(f), n(0) {}
+  ~RecordBuffer() { flush(); }
+
+  void flush() { if (n) std::fwrite(buf, 1, n, file); n = 0; }
+
+  void put(char c) { if (n == sizeof(buf)) flush(); buf[n++] = c; }
+  void put(const char * s, size_t len)
+  {
+    if (n + len > sizeof(buf)) flush();
+    if (len > sizeof(buf)) { std::fwrite(s, 1, len, file); return; }
+    memcpy(buf + n, s, len);
+    n += len;
+  }
+  void put(const char * s) { put(s, strlen(s)); }
+
+  void put_uint(uint64_t v)
+  {
+    char d[20];
+    size_t k = 0;
+    do { d[k++] = char('0' + v % 10); v /= 10; } while (v);
+    while (k) put(d[--k]);
+  }
+
+  /** Two decimals, like the "%.2f" of the text dump; false (and nothing written) if x is not
+   *  finite or if |x| >= 1e15, where x * 100 would no longer fit the integer formatting.
+   */
+  bool put_fixed2(double x);
+
+  /** A JSON string literal, or a CSV field that is quoted if it needs to be. */
+  void put_json_string(const char * s);
+  void put_csv_field(const char * s);
+
+private:
+  RecordBuffer(const RecordBuffer &);
+  RecordBuffer & operator=(const RecordBuffer &);
+
+  FILE * file;
+  size_t n;
+  char buf[65536];
+};
+
+
 /**** Utility functions, implemented in the source file. ****/
 
 
@@ -143,6 +1115,11 @@ std::string timecode_to_string(unsigned int tc);
 const char * weekday(unsigned int d);
 
 
+/** strftime() for a UTC timestamp; unlike gmtime(), this is safe to use from several threads.
+ */
+size_t strftime_utc(char * s, size_t max, const char * format, time_t t);
+
+
 /** A standard string tokenizer, returns a vector of tokens.
  */
 std::vector<std::string> tokenize(const std::string & str, const std::string & delimiters = " ");
@@ -166,11 +1143,33 @@ std::string read2ByteString(std::istream & in);
 std::string read2ByteStringN(std::istream & in, size_t N);
 
 
+/** UTF-16LE to UTF-8 on in-memory data, vectorised with SSE2/AVX2 where available.
+ *  utf16le_strnlen() returns the number of code units before the first NUL among the
+ *  first n units. utf16le_to_utf8() appends n code units to "out"; surrogate pairs are
+ *  combined, lone surrogates become U+FFFD and NUL units are dropped.
+ */
+size_t utf16le_strnlen(const unsigned char * in, size_t n);
+void utf16le_to_utf8(const unsigned char * in, size_t n, std::string & out);
+
+
+/** The positions of all command terminators in a chunk, in one pass over it (vectorised
+ *  with SSE2/AVX2 where available): every 0xFF in buf[0, len) that is preceded by
+ *  "zeros" 0x00 bytes, in increasing order. The dissectors then split the commands
+ *  along this list instead of searching byte by byte.
+ */
+void find_terminators(const unsigned char * buf, size_t len, unsigned int zeros, std::vector<uint32_t> & hits);
+
+
 /** Creates a UTF-8 representation of a single unicode codepoint.
  */
 void codepointToUTF8(unsigned int cp, codepoint_t * szOut);
 
 
+/** Parses a time code given as frames ("1234") or as minutes and seconds ("12:30").
+ */
+bool parse_timecode_arg(const char * str, uint32_t & tc);
+
+
 /** Parses an argument of the form "5,8,-7,0xAB" into a set of intergers.
  */
 std::set<int> parse_int_sequence_arg(char * str);
@@ -183,4 +1182,14 @@ inline bool is_filtered(int value, const std::set<int> & filterlist)
   return !filterlist.empty() && filterlist.find(value) == filterlist.end();
 }
 
+/** Checks whether "-H" drops a type-2 chunk: with "-t 2", "-H 1" keeps only the heartbeats
+ *  (every 15th time code, and time code 1), and "-H 0" only the other chunks.
+ */
+inline bool heartbeat_filtered(unsigned int timecode, const Options & opts)
+{
+  if (opts.type.count(2) == 0) return false;
+  const bool heartbeat = timecode % 15 == 0 || timecode == 1;
+  return (opts.filter_heartbeat == 1 && !heartbeat) || (opts.filter_heartbeat == 0 && heartbeat);
+}
+
 #endif